@@ -0,0 +1,116 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#include "detector.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static unsigned cfg_matches_needed = 3;
+static size_t cfg_recent_entries = 4;
+static unsigned cfg_misses_allowed = 2;
+
+static void
+load_config(void)
+{
+    const char *env_PRECACHE_DETECT_MATCHES = getenv("PRECACHE_DETECT_MATCHES");
+    if (env_PRECACHE_DETECT_MATCHES)
+        cfg_matches_needed = atol(env_PRECACHE_DETECT_MATCHES);
+    if (cfg_matches_needed < 1)
+        cfg_matches_needed = 1;
+
+    const char *env_PRECACHE_DETECT_RECENT = getenv("PRECACHE_DETECT_RECENT");
+    if (env_PRECACHE_DETECT_RECENT)
+        cfg_recent_entries = atol(env_PRECACHE_DETECT_RECENT);
+    if (cfg_recent_entries < 1)
+        cfg_recent_entries = 1;
+    if (cfg_recent_entries > DETECTOR_MAX_RECENT)
+        cfg_recent_entries = DETECTOR_MAX_RECENT;
+
+    const char *env_PRECACHE_DETECT_MISSES = getenv("PRECACHE_DETECT_MISSES");
+    if (env_PRECACHE_DETECT_MISSES)
+        cfg_misses_allowed = atol(env_PRECACHE_DETECT_MISSES);
+}
+
+void
+detector_reset(struct detector *d)
+{
+    pthread_once(&config_once, load_config);
+
+    d->recent_count = 0;
+    d->matches = 0;
+    d->misses = 0;
+    d->confirmed = false;
+}
+
+void
+detector_confirm(struct detector *d)
+{
+    d->matches = cfg_matches_needed;
+    d->misses = 0;
+    d->confirmed = true;
+}
+
+static void
+register_miss(struct detector *d)
+{
+    d->misses += 1;
+    if (d->misses <= cfg_misses_allowed)
+        return;
+
+    // That's not bulk reading, or it has ended. Start over.
+    d->matches = 0;
+    d->misses = 0;
+    d->confirmed = false;
+}
+
+static void
+remove_recent(struct detector *d, size_t k)
+{
+    d->recent_count -= 1;
+    memmove(&d->recent_names[k], &d->recent_names[k + 1],
+            (d->recent_count - k) * sizeof(d->recent_names[0]));
+    memmove(&d->recent_idx[k], &d->recent_idx[k + 1],
+            (d->recent_count - k) * sizeof(d->recent_idx[0]));
+}
+
+void
+detector_readdir(struct detector *d, const char *name, unsigned char d_type,
+                 size_t idx)
+{
+    // Only regular files are expected to be opened.
+    if (d_type != DT_REG && d_type != DT_UNKNOWN)
+        return;
+
+    if (d->recent_count >= cfg_recent_entries) {
+        remove_recent(d, 0);
+        register_miss(d);
+    }
+
+    d->recent_names[d->recent_count] = name;
+    d->recent_idx[d->recent_count] = idx;
+    d->recent_count += 1;
+}
+
+bool
+detector_open(struct detector *d, const char *name, size_t *idx)
+{
+    // Most likely it's the newest one.
+    for (size_t k = d->recent_count; k > 0; k--) {
+        if (strcmp(d->recent_names[k - 1], name) == 0) {
+            *idx = d->recent_idx[k - 1];
+            remove_recent(d, k - 1);
+
+            d->misses = 0;
+            d->matches += 1;
+            if (d->matches >= cfg_matches_needed)
+                d->confirmed = true;
+            return true;
+        }
+    }
+
+    register_miss(d);
+    return false;
+}
@@ -0,0 +1,46 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DETECTOR_MAX_RECENT 64
+
+// Detects bulk reading of a directory: consumer opens files shortly after
+// their entries were returned from readdir(). Each open of a recently returned
+// entry is a match. An open of anything else, or a returned entry that falls
+// out of the recent list unopened, is a miss. Enough matches confirm bulk
+// reading. Too many misses in a row start counting over, and cancel previous
+// confirmation.
+//
+// Thresholds are taken from environment variables PRECACHE_DETECT_MATCHES
+// (default 3), PRECACHE_DETECT_RECENT (default 4), and PRECACHE_DETECT_MISSES
+// (default 2).
+struct detector {
+    const char *recent_names[DETECTOR_MAX_RECENT];  // Oldest first.
+    size_t recent_idx[DETECTOR_MAX_RECENT];
+    size_t recent_count;
+    unsigned matches;
+    unsigned misses;
+    bool confirmed;
+};
+
+void
+detector_reset(struct detector *d);
+
+// Bulk reading is known by other means.
+void
+detector_confirm(struct detector *d);
+
+// Entry |name| of type |d_type| at index |idx| was returned to the consumer.
+// |name| should stay valid while the detector is in use.
+void
+detector_readdir(struct detector *d, const char *name, unsigned char d_type,
+                 size_t idx);
+
+// Consumer opened a file |name| in the directory. Returns true if that was one
+// of recently returned entries, and stores its index to |idx|.
+bool
+detector_open(struct detector *d, const char *name, size_t *idx);
@@ -0,0 +1,286 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include "dir_snapshot.h"
+#include "intercepted_functions.h"
+#include "mem.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Records are stored as they come from getdents64(), in struct dirent64
+// layout. It's used as struct dirent, so these must be the same.
+_Static_assert(sizeof(struct dirent) == sizeof(struct dirent64) &&
+                   offsetof(struct dirent, d_name) ==
+                       offsetof(struct dirent64, d_name),
+               "struct dirent is expected to precisely match struct dirent64");
+
+#define CHUNK_SIZE (64 * 1024)
+
+// Last chunk is filled further by getdents64() while it has this much room.
+// That's enough for several records of the longest name.
+#define MIN_READ_ROOM (4 * 1024)
+
+struct snapshot_chunk {
+    struct snapshot_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// Keeps records aligned, the same way the kernel does.
+static size_t
+align_reclen(size_t reclen)
+{
+    return (reclen + sizeof(long) - 1) & ~(sizeof(long) - 1);
+}
+
+static struct snapshot_chunk *
+alloc_chunk(size_t size)
+{
+    struct snapshot_chunk *chunk = xmalloc(sizeof(*chunk) + size);
+
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->size = size;
+    return chunk;
+}
+
+static void
+link_chunk(struct dir_snapshot *snapshot, struct snapshot_chunk *chunk)
+{
+    if (snapshot->last_chunk)
+        snapshot->last_chunk->next = chunk;
+    else
+        snapshot->chunks = chunk;
+    snapshot->last_chunk = chunk;
+}
+
+static struct snapshot_chunk *
+new_chunk(struct dir_snapshot *snapshot, size_t size)
+{
+    struct snapshot_chunk *chunk = alloc_chunk(size);
+
+    link_chunk(snapshot, chunk);
+    return chunk;
+}
+
+static void
+index_record(struct dir_snapshot *snapshot, struct dirent *de)
+{
+    if (snapshot->count == snapshot->capacity) {
+        snapshot->capacity =
+            snapshot->capacity > 0 ? snapshot->capacity * 2 : 1024;
+        snapshot->entries =
+            xrealloc(snapshot->entries,
+                     snapshot->capacity * sizeof(snapshot->entries[0]));
+    }
+
+    snapshot->entries[snapshot->count] = de;
+    snapshot->count += 1;
+}
+
+// Requires |snapshot->lock| to be held.
+static bool
+more_to_read(const struct dir_snapshot *snapshot)
+{
+    return snapshot->fd >= 0 || snapshot->open_pending;
+}
+
+// Requires |snapshot->lock| to be held.
+static void
+stop_reading(struct dir_snapshot *snapshot)
+{
+    if (snapshot->owns_fd && snapshot->fd >= 0)
+        real_close(snapshot->fd);
+    snapshot->fd = -1;
+    snapshot->open_pending = false;
+}
+
+// Reads one more chunk of entries. Requires |snapshot->lock| to be held.
+static void
+read_chunk(struct dir_snapshot *snapshot)
+{
+    if (snapshot->open_pending) {
+        snapshot->open_pending = false;
+        snapshot->owns_fd = true;
+        snapshot->fd = real_open(snapshot->dirname,
+                                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    if (snapshot->fd < 0)
+        return;
+
+    // Offset of the directory may have been changed by rewinddir().
+    if (snapshot->count > 0)
+        lseek(snapshot->fd, snapshot->next_off, SEEK_SET);
+
+    // Small directories fit into a single chunk. A new one is only linked
+    // once something is read into it.
+    struct snapshot_chunk *chunk = snapshot->last_chunk;
+    bool fresh = !chunk || chunk->size - chunk->used < MIN_READ_ROOM;
+    if (fresh)
+        chunk = alloc_chunk(CHUNK_SIZE);
+
+    size_t start = chunk->used;
+    long res = syscall(SYS_getdents64, snapshot->fd, chunk->data + start,
+                       chunk->size - start);
+    if (res <= 0) {
+        if (fresh)
+            free(chunk);
+        stop_reading(snapshot);
+        return;
+    }
+
+    if (fresh)
+        link_chunk(snapshot, chunk);
+
+    chunk->used += res;
+    for (size_t pos = start; pos < chunk->used;) {
+        struct dirent *de = (struct dirent *)(chunk->data + pos);
+        index_record(snapshot, de);
+        snapshot->next_off = de->d_off;
+        pos += de->d_reclen;
+    }
+}
+
+struct dir_snapshot *
+dir_snapshot_new_empty(const char *dirname)
+{
+    struct dir_snapshot *snapshot = xcalloc(1, sizeof(*snapshot));
+
+    snapshot->refcount = 1;
+    snapshot->dirname = xstrdup(dirname);
+    pthread_mutex_init(&snapshot->lock, NULL);
+    snapshot->fd = -1;
+    return snapshot;
+}
+
+struct dir_snapshot *
+dir_snapshot_new(const char *dirname, DIR *dirp)
+{
+    struct dir_snapshot *snapshot = dir_snapshot_new_empty(dirname);
+
+    snapshot->fd = dirfd(dirp);
+    return snapshot;
+}
+
+struct dir_snapshot *
+dir_snapshot_new_lazy(const char *dirname)
+{
+    struct dir_snapshot *snapshot = dir_snapshot_new_empty(dirname);
+
+    snapshot->open_pending = true;
+    return snapshot;
+}
+
+void
+dir_snapshot_append(struct dir_snapshot *snapshot, ino_t d_ino,
+                    unsigned char d_type, const char *d_name)
+{
+    size_t name_len = strlen(d_name);
+    size_t reclen =
+        align_reclen(offsetof(struct dirent, d_name) + name_len + 1);
+
+    pthread_mutex_lock(&snapshot->lock);
+
+    struct snapshot_chunk *chunk = snapshot->last_chunk;
+    if (!chunk || chunk->size - chunk->used < reclen)
+        chunk = new_chunk(snapshot, reclen > CHUNK_SIZE ? reclen : CHUNK_SIZE);
+
+    struct dirent *de = (struct dirent *)(chunk->data + chunk->used);
+    chunk->used += reclen;
+
+    memset(de, 0, offsetof(struct dirent, d_name));
+    de->d_ino = d_ino;
+    de->d_off = 0;
+    de->d_reclen = reclen;
+    de->d_type = d_type;
+    memcpy(de->d_name, d_name, name_len + 1);
+
+    index_record(snapshot, de);
+    pthread_mutex_unlock(&snapshot->lock);
+}
+
+struct dirent *
+dir_snapshot_entry(struct dir_snapshot *snapshot, size_t idx)
+{
+    struct dirent *de = NULL;
+
+    pthread_mutex_lock(&snapshot->lock);
+    while (idx >= snapshot->count && more_to_read(snapshot))
+        read_chunk(snapshot);
+    if (idx < snapshot->count)
+        de = snapshot->entries[idx];
+    pthread_mutex_unlock(&snapshot->lock);
+
+    return de;
+}
+
+size_t
+dir_snapshot_read_all(struct dir_snapshot *snapshot)
+{
+    pthread_mutex_lock(&snapshot->lock);
+    while (more_to_read(snapshot))
+        read_chunk(snapshot);
+    size_t count = snapshot->count;
+    pthread_mutex_unlock(&snapshot->lock);
+
+    return count;
+}
+
+void
+dir_snapshot_finish(struct dir_snapshot *snapshot, bool read_rest)
+{
+    pthread_mutex_lock(&snapshot->lock);
+    while (read_rest && more_to_read(snapshot))
+        read_chunk(snapshot);
+    stop_reading(snapshot);
+    pthread_mutex_unlock(&snapshot->lock);
+}
+
+size_t
+dir_snapshot_memory(struct dir_snapshot *snapshot)
+{
+    pthread_mutex_lock(&snapshot->lock);
+    size_t bytes = snapshot->capacity * sizeof(*snapshot->entries);
+    for (struct snapshot_chunk *chunk = snapshot->chunks; chunk != NULL;
+         chunk = chunk->next)  //
+    {
+        bytes += sizeof(*chunk) + chunk->size;
+    }
+    pthread_mutex_unlock(&snapshot->lock);
+
+    return bytes;
+}
+
+struct dir_snapshot *
+dir_snapshot_ref(struct dir_snapshot *snapshot)
+{
+    __atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+    return snapshot;
+}
+
+void
+dir_snapshot_unref(struct dir_snapshot *snapshot)
+{
+    if (!snapshot)
+        return;
+
+    if (__atomic_sub_fetch(&snapshot->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    stop_reading(snapshot);
+    while (snapshot->chunks) {
+        struct snapshot_chunk *chunk = snapshot->chunks;
+        snapshot->chunks = chunk->next;
+        free(chunk);
+    }
+
+    pthread_mutex_destroy(&snapshot->lock);
+    free(snapshot->entries);
+    free(snapshot->dirname);
+    free(snapshot);
+}
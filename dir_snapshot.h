@@ -0,0 +1,78 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct snapshot_chunk;
+
+// Copy of directory entries. Snapshots made from a DIR are filled lazily, in
+// large getdents64() chunks, only as far as someone asks for. Records are
+// stored in chunks that never move, so returned entries stay valid for the
+// lifetime of the snapshot. Snapshots are shared between DIR streams and
+// background precaching jobs, which may outlive the stream they were created
+// for, so they are reference counted and thread safe.
+struct dir_snapshot {
+    int refcount;
+    char *dirname;
+
+    pthread_mutex_t lock;  // Guards everything below.
+    struct snapshot_chunk *chunks;
+    struct snapshot_chunk *last_chunk;
+    struct dirent **entries;
+    size_t count;
+    size_t capacity;
+    int fd;          // Directory being read, or -1 if all is read.
+    off_t next_off;  // Position of the next entry in |fd|.
+    bool open_pending;  // Directory is opened by path on first access.
+    bool owns_fd;       // |fd| was opened here, not by a DIR.
+};
+
+// Entries are read from |dirp| on demand. Nothing else should read from it.
+// Returned snapshot has a reference count of one.
+struct dir_snapshot *
+dir_snapshot_new(const char *dirname, DIR *dirp);
+
+// Entries are read from directory |dirname|, which is only opened once they
+// are asked for. That may well happen on another thread.
+struct dir_snapshot *
+dir_snapshot_new_lazy(const char *dirname);
+
+// Creates a snapshot with no entries. They are to be added with
+// dir_snapshot_append().
+struct dir_snapshot *
+dir_snapshot_new_empty(const char *dirname);
+
+void
+dir_snapshot_append(struct dir_snapshot *snapshot, ino_t d_ino,
+                    unsigned char d_type, const char *d_name);
+
+// Returns entry |idx|, reading more of the directory if needed, or NULL if
+// there are not that many entries.
+struct dirent *
+dir_snapshot_entry(struct dir_snapshot *snapshot, size_t idx);
+
+// Reads all remaining entries, and returns the total number of them.
+size_t
+dir_snapshot_read_all(struct dir_snapshot *snapshot);
+
+// Stops reading from the DIR the snapshot was made from. Must be called before
+// that DIR is closed. Entries not read by then are not going to be in the
+// snapshot, unless |read_rest| is set.
+void
+dir_snapshot_finish(struct dir_snapshot *snapshot, bool read_rest);
+
+// Returns the number of bytes taken by entries read so far.
+size_t
+dir_snapshot_memory(struct dir_snapshot *snapshot);
+
+struct dir_snapshot *
+dir_snapshot_ref(struct dir_snapshot *snapshot);
+
+void
+dir_snapshot_unref(struct dir_snapshot *snapshot);
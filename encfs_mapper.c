@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/stat.h>
@@ -52,6 +53,10 @@ struct front_to_back_mapping {
 static struct front_to_back_mapping *front_to_back_map = NULL;
 static struct inode_to_path_mapping *inode_to_path_map = NULL;
 
+// Mapper is used both from intercepted functions and from the background
+// precaching thread.
+static pthread_mutex_t encfs_mapper_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static UT_icd uint64_icd = {sizeof(uint64_t), NULL, NULL, NULL};
 
 static char *
@@ -264,11 +269,14 @@ err:
 int
 encfs_mapper_force_refresh_mounts(void)
 {
-    return do_refresh_mounts();
+    pthread_mutex_lock(&encfs_mapper_mutex);
+    int res = do_refresh_mounts();
+    pthread_mutex_unlock(&encfs_mapper_mutex);
+    return res;
 }
 
-int
-encfs_mapper_refresh_mounts(const char *current_path)
+static int
+do_refresh_mounts_throttled(const char *current_path)
 {
     static struct timespec last_checked = {};
     struct timespec now;
@@ -298,6 +306,15 @@ encfs_mapper_refresh_mounts(const char *current_path)
     return do_refresh_mounts();
 }
 
+int
+encfs_mapper_refresh_mounts(const char *current_path)
+{
+    pthread_mutex_lock(&encfs_mapper_mutex);
+    int res = do_refresh_mounts_throttled(current_path);
+    pthread_mutex_unlock(&encfs_mapper_mutex);
+    return res;
+}
+
 static UT_array *
 trace_inodes_back_to_base(const char *src_path, const char *encfs_front)
 {
@@ -477,8 +494,8 @@ follow_inode_trace(UT_array *inode_trace, const char *base)
     return cur_path;
 }
 
-char *
-encfs_mapper_resolve_path(const char *src_path)
+static char *
+do_resolve_path(const char *src_path)
 {
     LOG("%s> src_path=%s", __func__, src_path);
     struct statfs sfsb;
@@ -542,9 +559,20 @@ done:
     return res;
 }
 
+char *
+encfs_mapper_resolve_path(const char *src_path)
+{
+    pthread_mutex_lock(&encfs_mapper_mutex);
+    char *res = do_resolve_path(src_path);
+    pthread_mutex_unlock(&encfs_mapper_mutex);
+    return res;
+}
+
 void
 encfs_mapper_cleanup(void)
 {
+    pthread_mutex_lock(&encfs_mapper_mutex);
     clear_front_to_back_map();
     clear_inode_to_path_map();
+    pthread_mutex_unlock(&encfs_mapper_mutex);
 }
@@ -0,0 +1,396 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#include "extent_cache.h"
+#include "intercepted_functions.h"
+#include "mem.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <uthash.h>
+#include <utstring.h>
+
+#define CACHE_MAGIC "PCEXTC1"
+
+// File layout: header, entries sorted by (dev, ino), then extents. Extents of
+// an entry are consecutive.
+struct cache_header {
+    char magic[8];
+    uint64_t entry_count;
+    uint64_t extent_count;
+};
+
+struct cache_key {
+    uint64_t dev;
+    uint64_t ino;
+};
+
+struct cache_entry {
+    struct cache_key key;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint64_t first_extent;
+    uint64_t extent_count;
+};
+
+struct new_entry {
+    UT_hash_handle hh;
+    struct cache_entry entry;
+    struct cached_extent *extents;
+};
+
+struct extent_cache {
+    char *path;
+
+    void *map;  // NULL if there was no usable cache file.
+    size_t map_len;
+    const struct cache_entry *entries;
+    size_t entry_count;
+    const struct cached_extent *extents;
+    size_t extent_count;
+
+    // Bit per entry of the file, set once it's found out of date. Such
+    // entries are dropped when the file is rewritten.
+    uint8_t *stale;
+    bool has_stale;
+
+    pthread_mutex_t lock;  // Guards |new_entries|.
+    struct new_entry *new_entries;
+};
+
+// Walks old and new entries together, in key order. New entries replace old
+// ones with the same key.
+struct merge_cursor {
+    const struct extent_cache *cache;
+    size_t old_idx;
+    const struct new_entry *next_new;
+};
+
+static int
+key_compare(const struct cache_key *a, const struct cache_key *b)
+{
+    if (a->dev != b->dev)
+        return a->dev < b->dev ? -1 : 1;
+    if (a->ino != b->ino)
+        return a->ino < b->ino ? -1 : 1;
+    return 0;
+}
+
+static int
+new_entry_comparator(const void *a, const void *b)
+{
+    const struct new_entry *a_ = a;
+    const struct new_entry *b_ = b;
+
+    return key_compare(&a_->entry.key, &b_->entry.key);
+}
+
+static void
+fill_entry(struct cache_entry *entry, const struct stat *sb)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->key.dev = sb->st_dev;
+    entry->key.ino = sb->st_ino;
+    entry->size = sb->st_size;
+    entry->mtime_sec = sb->st_mtim.tv_sec;
+    entry->mtime_nsec = sb->st_mtim.tv_nsec;
+    entry->ctime_sec = sb->st_ctim.tv_sec;
+    entry->ctime_nsec = sb->st_ctim.tv_nsec;
+}
+
+static bool
+entry_matches(const struct cache_entry *entry, const struct stat *sb)
+{
+    return entry->size == (uint64_t)sb->st_size &&
+           entry->mtime_sec == sb->st_mtim.tv_sec &&
+           entry->mtime_nsec == (uint32_t)sb->st_mtim.tv_nsec &&
+           entry->ctime_sec == sb->st_ctim.tv_sec &&
+           entry->ctime_nsec == (uint32_t)sb->st_ctim.tv_nsec;
+}
+
+static void
+mark_stale(struct extent_cache *cache, size_t idx)
+{
+    __atomic_or_fetch(&cache->stale[idx / 8], 1u << (idx % 8),
+                      __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->has_stale, true, __ATOMIC_RELAXED);
+}
+
+static bool
+is_stale(const struct extent_cache *cache, size_t idx)
+{
+    return __atomic_load_n(&cache->stale[idx / 8], __ATOMIC_RELAXED) &
+           (1u << (idx % 8));
+}
+
+// Extents of an entry may point outside of a damaged file.
+static bool
+old_entry_valid(const struct extent_cache *cache,
+                const struct cache_entry *entry)
+{
+    return entry->first_extent <= cache->extent_count &&
+           entry->extent_count <= cache->extent_count - entry->first_extent;
+}
+
+static void
+map_cache_file(struct extent_cache *cache)
+{
+    int fd = real_open(cache->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 ||
+        (size_t)sb.st_size < sizeof(struct cache_header))  //
+    {
+        goto done;
+    }
+
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        goto done;
+
+    const struct cache_header *header = map;
+    uint64_t expected_size =
+        sizeof(*header) + header->entry_count * sizeof(struct cache_entry) +
+        header->extent_count * sizeof(struct cached_extent);
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->entry_count > (uint64_t)sb.st_size ||
+        header->extent_count > (uint64_t)sb.st_size ||
+        expected_size != (uint64_t)sb.st_size)  //
+    {
+        munmap(map, sb.st_size);
+        goto done;
+    }
+
+    cache->map = map;
+    cache->map_len = sb.st_size;
+    cache->entries = (const void *)(header + 1);
+    cache->entry_count = header->entry_count;
+    cache->extents = (const void *)(cache->entries + cache->entry_count);
+    cache->extent_count = header->extent_count;
+    cache->stale = xcalloc((cache->entry_count + 7) / 8 + 1, 1);
+
+done:
+    real_close(fd);
+}
+
+struct extent_cache *
+extent_cache_open(void)
+{
+    const char *env_PRECACHE_EXTENT_CACHE = getenv("PRECACHE_EXTENT_CACHE");
+    if (!env_PRECACHE_EXTENT_CACHE || env_PRECACHE_EXTENT_CACHE[0] == '\0')
+        return NULL;
+
+    struct extent_cache *cache = xcalloc(1, sizeof(*cache));
+    cache->path = xstrdup(env_PRECACHE_EXTENT_CACHE);
+    pthread_mutex_init(&cache->lock, NULL);
+    map_cache_file(cache);
+
+    return cache;
+}
+
+static bool
+merge_next(struct merge_cursor *cursor, const struct cache_entry **entry,
+           const struct cached_extent **extents)
+{
+    const struct extent_cache *cache = cursor->cache;
+
+    while (cursor->old_idx < cache->entry_count || cursor->next_new) {
+        const struct cache_entry *old = NULL;
+        if (cursor->old_idx < cache->entry_count)
+            old = &cache->entries[cursor->old_idx];
+
+        const struct new_entry *ne = cursor->next_new;
+        int cmp = !old ? 1 : !ne ? -1 : key_compare(&old->key, &ne->entry.key);
+
+        if (cmp >= 0) {
+            if (cmp == 0)
+                cursor->old_idx += 1;
+            cursor->next_new = ne->hh.next;
+            *entry = &ne->entry;
+            *extents = ne->extents;
+            return true;
+        }
+
+        cursor->old_idx += 1;
+        if (!is_stale(cache, cursor->old_idx - 1) &&
+            old_entry_valid(cache, old))  //
+        {
+            *entry = old;
+            *extents = cache->extents + old->first_extent;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+write_cache_file(struct extent_cache *cache, FILE *fp)
+{
+    struct cache_header header = {.magic = CACHE_MAGIC};
+    const struct cache_entry *entry;
+    const struct cached_extent *extents;
+    struct merge_cursor cursor;
+
+    // Header is rewritten with actual counts at the end.
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        return false;
+
+    cursor = (struct merge_cursor){cache, 0, cache->new_entries};
+    while (merge_next(&cursor, &entry, &extents)) {
+        struct cache_entry out = *entry;
+        out.first_extent = header.extent_count;
+        if (fwrite(&out, sizeof(out), 1, fp) != 1)
+            return false;
+        header.entry_count += 1;
+        header.extent_count += entry->extent_count;
+    }
+
+    cursor = (struct merge_cursor){cache, 0, cache->new_entries};
+    while (merge_next(&cursor, &entry, &extents)) {
+        if (fwrite(extents, sizeof(*extents), entry->extent_count, fp) !=
+            entry->extent_count)  //
+        {
+            return false;
+        }
+    }
+
+    return fseek(fp, 0, SEEK_SET) == 0 &&
+           fwrite(&header, sizeof(header), 1, fp) == 1;
+}
+
+// Writes a new file next to the old one, and renames it over, so concurrent
+// readers see either of them in full.
+static void
+save_cache(struct extent_cache *cache)
+{
+    UT_string tmp_path;
+
+    HASH_SRT(hh, cache->new_entries, new_entry_comparator);
+
+    utstring_init(&tmp_path);
+    utstring_printf(&tmp_path, "%s.XXXXXX", cache->path);
+
+    int fd = mkstemp(utstring_body(&tmp_path));
+    if (fd < 0)
+        goto err_1;
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        real_close(fd);
+        goto err_2;
+    }
+
+    bool written = write_cache_file(cache, fp);
+    if (fclose(fp) != 0 || !written)
+        goto err_2;
+
+    if (rename(utstring_body(&tmp_path), cache->path) != 0)
+        goto err_2;
+
+    utstring_done(&tmp_path);
+    return;
+
+err_2:
+    unlink(utstring_body(&tmp_path));
+err_1:
+    fprintf(stderr, "Warning: can't write extent cache %s\n", cache->path);
+    utstring_done(&tmp_path);
+}
+
+void
+extent_cache_close(struct extent_cache *cache)
+{
+    if (!cache)
+        return;
+
+    if (cache->new_entries || cache->has_stale)
+        save_cache(cache);
+
+    struct new_entry *ne, *tmp;
+    HASH_ITER (hh, cache->new_entries, ne, tmp) {
+        HASH_DEL(cache->new_entries, ne);
+        free(ne->extents);
+        free(ne);
+    }
+
+    if (cache->map)
+        munmap(cache->map, cache->map_len);
+    free(cache->stale);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->path);
+    free(cache);
+}
+
+bool
+extent_cache_lookup(struct extent_cache *cache, const struct stat *sb,
+                    const struct cached_extent **extents, size_t *count)
+{
+    if (!cache)
+        return false;
+
+    struct cache_key key = {.dev = sb->st_dev, .ino = sb->st_ino};
+    size_t lo = 0;
+    size_t hi = cache->entry_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct cache_entry *entry = &cache->entries[mid];
+        int cmp = key_compare(&entry->key, &key);
+
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else if (cmp > 0) {
+            hi = mid;
+        } else {
+            if (!entry_matches(entry, sb) ||
+                !old_entry_valid(cache, entry))  //
+            {
+                // File has changed, or its inode is reused.
+                mark_stale(cache, mid);
+                return false;
+            }
+            *extents = cache->extents + entry->first_extent;
+            *count = entry->extent_count;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+extent_cache_store(struct extent_cache *cache, const struct stat *sb,
+                   const struct cached_extent *extents, size_t count)
+{
+    if (!cache)
+        return;
+
+    struct new_entry *ne = xcalloc(1, sizeof(*ne));
+    fill_entry(&ne->entry, sb);
+    ne->entry.extent_count = count;
+    ne->extents = xmalloc((count + 1) * sizeof(*extents));
+    memcpy(ne->extents, extents, count * sizeof(*extents));
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct new_entry *old;
+    HASH_FIND(hh, cache->new_entries, &ne->entry.key, sizeof(ne->entry.key),
+              old);
+    if (old) {
+        HASH_DEL(cache->new_entries, old);
+        free(old->extents);
+        free(old);
+    }
+    HASH_ADD(hh, cache->new_entries, entry.key, sizeof(ne->entry.key), ne);
+
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,44 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// On-disk cache of file extents, so files that haven't changed since the last
+// run don't need FIEMAP. Entries are keyed by device and inode, and are valid
+// while size, mtime and ctime stay the same. As callers fstat() files anyway,
+// revalidation costs nothing. The file is mmap()ed, and looked up with a
+// binary search. New entries are kept in memory and merged into the file on
+// close. Entries found out of date by lookups are dropped then. The library
+// only reads the cache, precache and precache-dir write it. Thread safe.
+struct extent_cache;
+
+struct cached_extent {
+    uint64_t physical_pos;
+    uint64_t file_offset;
+    uint64_t extent_length;
+};
+
+// Opens the cache at PRECACHE_EXTENT_CACHE. Returns NULL if the variable is
+// not set. Missing or damaged cache files count as empty.
+struct extent_cache *
+extent_cache_open(void);
+
+// Writes the cache back, if there are new entries, and frees it.
+void
+extent_cache_close(struct extent_cache *cache);
+
+// Finds extents of the file described by |sb|. Returns false if there is no
+// valid entry. Returned extents stay valid until the cache is closed.
+bool
+extent_cache_lookup(struct extent_cache *cache, const struct stat *sb,
+                    const struct cached_extent **extents, size_t *count);
+
+// Remembers extents of the file described by |sb|. They are copied.
+void
+extent_cache_store(struct extent_cache *cache, const struct stat *sb,
+                   const struct cached_extent *extents, size_t count);
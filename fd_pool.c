@@ -0,0 +1,170 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#include "fd_pool.h"
+#include "intercepted_functions.h"
+#include "mem.h"
+#include "read_engine.h"
+#include <pthread.h>
+#include <sys/resource.h>
+#include <utlist.h>
+
+// Lower bound, for processes with unusually low limits.
+#define MIN_OPEN_FILES 16
+
+struct fd_pool {
+    pthread_mutex_t lock;
+    struct pooled_file *by_path;
+    struct pooled_file *lru;  // Open files, least recently used first.
+    size_t open_count;
+    size_t max_open;
+};
+
+struct fd_pool *
+fd_pool_new(unsigned share)
+{
+    struct fd_pool *pool = xcalloc(1, sizeof(*pool));
+    struct rlimit rl;
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pool->max_open = 1024 / share;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        pool->max_open = rl.rlim_cur / share;
+    if (pool->max_open < MIN_OPEN_FILES)
+        pool->max_open = MIN_OPEN_FILES;
+
+    return pool;
+}
+
+void
+fd_pool_free(struct fd_pool *pool)
+{
+    if (!pool)
+        return;
+
+    // Entries are owned by the segments referring to them, and should all be
+    // gone by now.
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static void
+close_file(struct fd_pool *pool, struct pooled_file *file)
+{
+    DL_DELETE2(pool->lru, file, lru_prev, lru_next);
+    real_close(file->fd);
+    file->fd = -1;
+    pool->open_count -= 1;
+}
+
+struct pooled_file *
+fd_pool_get(struct fd_pool *pool, const char *path)
+{
+    struct pooled_file *file;
+
+    pthread_mutex_lock(&pool->lock);
+
+    HASH_FIND_STR(pool->by_path, path, file);
+    if (file) {
+        file->refcount += 1;
+        pthread_mutex_unlock(&pool->lock);
+        return file;
+    }
+
+    file = xcalloc(1, sizeof(*file));
+    file->pool = pool;
+    file->path = xstrdup(path);
+    file->fd = -1;
+    file->refcount = 1;
+    HASH_ADD_KEYPTR(hh, pool->by_path, file->path, strlen(file->path), file);
+
+    pthread_mutex_unlock(&pool->lock);
+    return file;
+}
+
+struct pooled_file *
+fd_pool_ref(struct pooled_file *file)
+{
+    pthread_mutex_lock(&file->pool->lock);
+    file->refcount += 1;
+    pthread_mutex_unlock(&file->pool->lock);
+    return file;
+}
+
+static void
+unref_locked(struct fd_pool *pool, struct pooled_file *file)
+{
+    if (--file->refcount > 0)
+        return;
+
+    HASH_DEL(pool->by_path, file);
+    if (file->fd >= 0)
+        close_file(pool, file);
+    free(file->path);
+    free(file);
+}
+
+void
+fd_pool_unref(struct pooled_file *file)
+{
+    struct fd_pool *pool = file->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    unref_locked(pool, file);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Closes least recently used files that are not pinned, until there is room
+// for one more.
+static void
+make_room(struct fd_pool *pool)
+{
+    struct pooled_file *it, *tmp;
+
+    for (it = pool->lru; it && pool->open_count >= pool->max_open; it = tmp) {
+        tmp = it->lru_next;
+        if (it->pin_count == 0)
+            close_file(pool, it);
+    }
+}
+
+int
+fd_pool_pin(struct pooled_file *file)
+{
+    struct fd_pool *pool = file->pool;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (file->fd < 0) {
+        // If everything is pinned, the pool grows over the limit for a while.
+        make_room(pool);
+        file->fd = read_engine_open(file->path);
+        if (file->fd < 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
+        }
+        pool->open_count += 1;
+    } else {
+        DL_DELETE2(pool->lru, file, lru_prev, lru_next);
+    }
+
+    DL_APPEND2(pool->lru, file, lru_prev, lru_next);
+    file->refcount += 1;
+    file->pin_count += 1;
+    int fd = file->fd;
+
+    pthread_mutex_unlock(&pool->lock);
+    return fd;
+}
+
+void
+fd_pool_unpin(struct pooled_file *file)
+{
+    struct fd_pool *pool = file->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    file->pin_count -= 1;
+    unref_locked(pool, file);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,50 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <uthash.h>
+
+// Table of files referred to by segments. Each file is looked up by path once,
+// and its descriptor is shared by the mapping and read phases, and by all
+// segments of the file. Open descriptors form an LRU pool, bounded by a share
+// of RLIMIT_NOFILE. Descriptors that are not pinned get closed when the pool
+// is full, and are reopened when needed again. Thread safe.
+struct fd_pool;
+
+struct pooled_file {
+    UT_hash_handle hh;
+    struct fd_pool *pool;
+    char *path;
+    int fd;  // -1 if closed.
+    int refcount;
+    int pin_count;
+    struct pooled_file *lru_prev, *lru_next;
+};
+
+// Pool keeps at most 1/|share| of RLIMIT_NOFILE descriptors open.
+struct fd_pool *
+fd_pool_new(unsigned share);
+
+void
+fd_pool_free(struct fd_pool *pool);
+
+// Returns a referenced entry for |path|. Nothing is opened yet.
+struct pooled_file *
+fd_pool_get(struct fd_pool *pool, const char *path);
+
+struct pooled_file *
+fd_pool_ref(struct pooled_file *file);
+
+// File is closed, and its entry is dropped, with the last reference.
+void
+fd_pool_unref(struct pooled_file *file);
+
+// Returns a descriptor of |file|, opening it if needed, or -1. Descriptor
+// stays valid until fd_pool_unpin(). Pinning also holds a reference.
+int
+fd_pool_pin(struct pooled_file *file);
+
+void
+fd_pool_unpin(struct pooled_file *file);
@@ -12,13 +12,44 @@ int (*real_open)(const char *fname, int oflag, ...);
 int (*real_open64)(const char *fname, int oflag, ...);
 int (*real_openat)(int atfd, const char *fname, int oflag, ...);
 int (*real_openat64)(int atfd, const char *fname, int oflag, ...);
+int (*real___open_2)(const char *fname, int oflag);
+int (*real___open64_2)(const char *fname, int oflag);
+int (*real___openat_2)(int atfd, const char *fname, int oflag);
+int (*real___openat64_2)(int atfd, const char *fname, int oflag);
+FILE *(*real_fopen)(const char *fname, const char *mode);
+FILE *(*real_fopen64)(const char *fname, const char *mode);
 int (*real_close)(int fd);
 ssize_t (*real_read)(int fd, const void *buf, size_t count);
 DIR *(*real_opendir)(const char *name);
+DIR *(*real_fdopendir)(int fd);
 struct dirent *(*real_readdir)(DIR *dirp);
 struct dirent64 *(*real_readdir64)(DIR *dirp);
+int (*real_readdir_r)(DIR *dirp, struct dirent *entry,
+                      struct dirent **result);
+int (*real_scandirat)(int dirfd, const char *dirp, struct dirent ***namelist,
+                      int (*filter)(const struct dirent *),
+                      int (*compar)(const struct dirent **,
+                                    const struct dirent **));
 int (*real_closedir)(DIR *dirp);
 void (*real_rewinddir)(DIR *dirp);
+FTS *(*real_fts_open)(char *const *path_argv, int options,
+                      int (*compar)(const FTSENT **, const FTSENT **));
+FTSENT *(*real_fts_read)(FTS *ftsp);
+FTSENT *(*real_fts_children)(FTS *ftsp, int instr);
+int (*real_fts_close)(FTS *ftsp);
+FTS *(*real_fts64_open)(char *const *path_argv, int options,
+                        int (*compar)(const FTSENT **, const FTSENT **));
+FTSENT *(*real_fts64_read)(FTS *ftsp);
+FTSENT *(*real_fts64_children)(FTS *ftsp, int instr);
+int (*real_fts64_close)(FTS *ftsp);
+int (*real_nftw)(const char *dirpath,
+                 int (*fn)(const char *fpath, const struct stat *sb,
+                           int typeflag, struct FTW *ftwbuf),
+                 int nopenfd, int flags);
+int (*real_nftw64)(const char *dirpath,
+                   int (*fn)(const char *fpath, const struct stat *sb,
+                             int typeflag, struct FTW *ftwbuf),
+                   int nopenfd, int flags);
 
 static void
 initialize(void)
@@ -27,13 +58,32 @@ initialize(void)
     real_open64 = dlsym(RTLD_NEXT, "open64");
     real_openat = dlsym(RTLD_NEXT, "openat");
     real_openat64 = dlsym(RTLD_NEXT, "openat64");
+    real___open_2 = dlsym(RTLD_NEXT, "__open_2");
+    real___open64_2 = dlsym(RTLD_NEXT, "__open64_2");
+    real___openat_2 = dlsym(RTLD_NEXT, "__openat_2");
+    real___openat64_2 = dlsym(RTLD_NEXT, "__openat64_2");
+    real_fopen = dlsym(RTLD_NEXT, "fopen");
+    real_fopen64 = dlsym(RTLD_NEXT, "fopen64");
     real_read = dlsym(RTLD_NEXT, "read");
     real_close = dlsym(RTLD_NEXT, "close");
     real_opendir = dlsym(RTLD_NEXT, "opendir");
+    real_fdopendir = dlsym(RTLD_NEXT, "fdopendir");
     real_readdir = dlsym(RTLD_NEXT, "readdir");
     real_readdir64 = dlsym(RTLD_NEXT, "readdir64");
+    real_readdir_r = dlsym(RTLD_NEXT, "readdir_r");
+    real_scandirat = dlsym(RTLD_NEXT, "scandirat");
     real_closedir = dlsym(RTLD_NEXT, "closedir");
     real_rewinddir = dlsym(RTLD_NEXT, "rewinddir");
+    real_fts_open = dlsym(RTLD_NEXT, "fts_open");
+    real_fts_read = dlsym(RTLD_NEXT, "fts_read");
+    real_fts_children = dlsym(RTLD_NEXT, "fts_children");
+    real_fts_close = dlsym(RTLD_NEXT, "fts_close");
+    real_fts64_open = dlsym(RTLD_NEXT, "fts64_open");
+    real_fts64_read = dlsym(RTLD_NEXT, "fts64_read");
+    real_fts64_children = dlsym(RTLD_NEXT, "fts64_children");
+    real_fts64_close = dlsym(RTLD_NEXT, "fts64_close");
+    real_nftw = dlsym(RTLD_NEXT, "nftw");
+    real_nftw64 = dlsym(RTLD_NEXT, "nftw64");
 }
 
 void
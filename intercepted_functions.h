@@ -4,19 +4,60 @@
 #pragma once
 
 #include <dirent.h>
+#include <fts.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+struct FTW;
+struct stat;
+
 extern int (*real_open)(const char *fname, int oflag, ...);
 extern int (*real_open64)(const char *fname, int oflag, ...);
 extern int (*real_openat)(int atfd, const char *fname, int oflag, ...);
 extern int (*real_openat64)(int atfd, const char *fname, int oflag, ...);
+extern int (*real___open_2)(const char *fname, int oflag);
+extern int (*real___open64_2)(const char *fname, int oflag);
+extern int (*real___openat_2)(int atfd, const char *fname, int oflag);
+extern int (*real___openat64_2)(int atfd, const char *fname, int oflag);
+extern FILE *(*real_fopen)(const char *fname, const char *mode);
+extern FILE *(*real_fopen64)(const char *fname, const char *mode);
 extern int (*real_close)(int fd);
 extern ssize_t (*real_read)(int fd, const void *buf, size_t count);
 extern DIR *(*real_opendir)(const char *name);
+extern DIR *(*real_fdopendir)(int fd);
 extern struct dirent *(*real_readdir)(DIR *dirp);
 extern struct dirent64 *(*real_readdir64)(DIR *dirp);
+extern int (*real_readdir_r)(DIR *dirp, struct dirent *entry,
+                             struct dirent **result);
+extern int (*real_scandirat)(int dirfd, const char *dirp,
+                             struct dirent ***namelist,
+                             int (*filter)(const struct dirent *),
+                             int (*compar)(const struct dirent **,
+                                           const struct dirent **));
 extern int (*real_closedir)(DIR *dirp);
 extern void (*real_rewinddir)(DIR *dirp);
+extern FTS *(*real_fts_open)(char *const *path_argv, int options,
+                             int (*compar)(const FTSENT **, const FTSENT **));
+extern FTSENT *(*real_fts_read)(FTS *ftsp);
+extern FTSENT *(*real_fts_children)(FTS *ftsp, int instr);
+extern int (*real_fts_close)(FTS *ftsp);
+
+// Large file variants of fts functions are declared with regular types. They
+// are only used where these types match.
+extern FTS *(*real_fts64_open)(char *const *path_argv, int options,
+                               int (*compar)(const FTSENT **, const FTSENT **));
+extern FTSENT *(*real_fts64_read)(FTS *ftsp);
+extern FTSENT *(*real_fts64_children)(FTS *ftsp, int instr);
+extern int (*real_fts64_close)(FTS *ftsp);
+
+extern int (*real_nftw)(const char *dirpath,
+                        int (*fn)(const char *fpath, const struct stat *sb,
+                                  int typeflag, struct FTW *ftwbuf),
+                        int nopenfd, int flags);
+extern int (*real_nftw64)(const char *dirpath,
+                          int (*fn)(const char *fpath, const struct stat *sb,
+                                    int typeflag, struct FTW *ftwbuf),
+                          int nopenfd, int flags);
 
 void
 ensure_initialized(void);
@@ -0,0 +1,435 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include "io_queue.h"
+#include "intercepted_functions.h"
+#include "mem.h"
+#include "read_engine.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Large segments are split into reads of this size, so they don't hold up a
+// single slot for long.
+#define CHUNK_SIZE (256 * 1024)
+
+#define DEFAULT_QUEUE_DEPTH 32
+
+// Read split into chunks.
+struct queued_read {
+    int fd;
+    io_queue_done_fn done;
+    void *done_arg;
+    int refcount;
+};
+
+struct slot {
+    struct queued_read *read;
+    char *buf;
+    uint64_t offset;
+    uint32_t length;
+};
+
+struct io_queue {
+    // Ring, or -1 if reads are done synchronously.
+    int ring_fd;
+    unsigned depth;
+    unsigned in_flight;
+    uint64_t bytes_read;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct slot *slots;
+    unsigned *free_slots;
+    unsigned free_count;
+};
+
+static void
+unref_queued_read(struct queued_read *read)
+{
+    if (--read->refcount > 0)
+        return;
+
+    if (read->done)
+        read->done(read->done_arg);
+    free(read);
+}
+
+static bool
+setup_ring(struct io_queue *queue)
+{
+    struct io_uring_params params = {};
+
+    int ring_fd = syscall(__NR_io_uring_setup, queue->depth, &params);
+    if (ring_fd < 0)
+        return false;
+
+    queue->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    queue->cq_len =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (queue->cq_len > queue->sq_len)
+            queue->sq_len = queue->cq_len;
+        queue->cq_len = 0;
+    }
+
+    queue->sq_ptr =
+        mmap(NULL, queue->sq_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (queue->sq_ptr == MAP_FAILED)
+        goto err_1;
+
+    if (queue->cq_len > 0) {
+        queue->cq_ptr =
+            mmap(NULL, queue->cq_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (queue->cq_ptr == MAP_FAILED)
+            goto err_2;
+    } else {
+        queue->cq_ptr = queue->sq_ptr;
+    }
+
+    queue->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    queue->sqes = mmap(NULL, queue->sqes_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (queue->sqes == MAP_FAILED)
+        goto err_3;
+
+    char *sq = queue->sq_ptr;
+    char *cq = queue->cq_ptr;
+    queue->sq_head = (unsigned *)(sq + params.sq_off.head);
+    queue->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    queue->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    queue->sq_array = (unsigned *)(sq + params.sq_off.array);
+    queue->cq_head = (unsigned *)(cq + params.cq_off.head);
+    queue->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    queue->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    queue->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Completion ring is twice as large, in-flight reads are limited by the
+    // submission ring size.
+    if (params.sq_entries < queue->depth)
+        queue->depth = params.sq_entries;
+
+    queue->ring_fd = ring_fd;
+    return true;
+
+err_3:
+    if (queue->cq_len > 0)
+        munmap(queue->cq_ptr, queue->cq_len);
+err_2:
+    munmap(queue->sq_ptr, queue->sq_len);
+err_1:
+    real_close(ring_fd);
+    return false;
+}
+
+struct io_queue *
+io_queue_new(void)
+{
+    struct io_queue *queue = xcalloc(1, sizeof(*queue));
+
+    queue->ring_fd = -1;
+    queue->depth = DEFAULT_QUEUE_DEPTH;
+    const char *env_PRECACHE_QUEUE_DEPTH = getenv("PRECACHE_QUEUE_DEPTH");
+    if (env_PRECACHE_QUEUE_DEPTH)
+        queue->depth = atoi(env_PRECACHE_QUEUE_DEPTH);
+
+    if (read_engine_get() != READ_ENGINE_IO_URING || queue->depth < 2)
+        return queue;
+
+    if (!setup_ring(queue))
+        return queue;
+
+    queue->slots = xcalloc(queue->depth, sizeof(queue->slots[0]));
+    queue->free_slots = xmalloc(queue->depth * sizeof(queue->free_slots[0]));
+    for (unsigned k = 0; k < queue->depth; k++) {
+        queue->slots[k].buf = xmalloc(CHUNK_SIZE);
+        queue->free_slots[k] = k;
+    }
+    queue->free_count = queue->depth;
+
+    return queue;
+}
+
+static void
+release_slot(struct io_queue *queue, unsigned slot_idx)
+{
+    struct slot *slot = &queue->slots[slot_idx];
+
+    unref_queued_read(slot->read);
+    slot->read = NULL;
+    queue->free_slots[queue->free_count++] = slot_idx;
+}
+
+static void
+teardown_ring(struct io_queue *queue)
+{
+    munmap(queue->sqes, queue->sqes_len);
+    if (queue->cq_len > 0)
+        munmap(queue->cq_ptr, queue->cq_len);
+    munmap(queue->sq_ptr, queue->sq_len);
+    real_close(queue->ring_fd);
+    queue->ring_fd = -1;
+}
+
+// Reads that should be tried again, e.g. synchronously.
+static bool
+is_retryable(int res)
+{
+    return res == -EINTR || res == -EAGAIN || res == -EINVAL ||
+           res == -EOPNOTSUPP;
+}
+
+// Ring is unusable. Does the reads it still has synchronously, and switches
+// the queue to read_engine_populate() for good. Completions not reaped yet
+// are taken into account first, so finished reads are not repeated, and
+// short ones only read the rest.
+static void
+abandon_ring(struct io_queue *queue)
+{
+    unsigned head = *queue->cq_head;
+
+    while (head != __atomic_load_n(queue->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &queue->cqes[head & *queue->cq_mask];
+        struct slot *slot = &queue->slots[cqe->user_data];
+        int res = cqe->res;
+
+        head += 1;
+        if (res > 0) {
+            queue->bytes_read += res;
+            slot->offset += res;
+            slot->length -= res;
+        } else if (!is_retryable(res)) {
+            // End of the file, or an error.
+            slot->length = 0;
+        }
+    }
+    __atomic_store_n(queue->cq_head, head, __ATOMIC_RELEASE);
+
+    for (unsigned k = 0; k < queue->depth; k++) {
+        struct slot *slot = &queue->slots[k];
+        if (!slot->read)
+            continue;
+
+        if (slot->length > 0) {
+            queue->bytes_read += read_engine_populate(
+                slot->read->fd, slot->offset, slot->length);
+        }
+        release_slot(queue, k);
+    }
+
+    queue->in_flight = 0;
+    teardown_ring(queue);
+}
+
+// Submits entries the kernel hasn't taken yet, and waits for |min_complete|
+// completions. Returns false if the ring can't be used.
+static bool
+enter_ring(struct io_queue *queue, unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    bool submit = true;
+
+    while (1) {
+        unsigned pending =
+            *queue->sq_tail - __atomic_load_n(queue->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, queue->ring_fd, submit ? pending : 0,
+                    min_complete, flags, NULL, 0) >= 0)  //
+        {
+            return true;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        // Kernel is short on resources. That passes as reads complete, but
+        // only if some were submitted. Pending entries are submitted later.
+        if ((errno == EAGAIN || errno == EBUSY) &&
+            queue->in_flight > pending)  //
+        {
+            if (min_complete == 0 || !submit)
+                return true;
+            submit = false;
+            continue;
+        }
+
+        return false;
+    }
+}
+
+static void
+submit_slot(struct io_queue *queue, unsigned slot_idx)
+{
+    struct slot *slot = &queue->slots[slot_idx];
+    unsigned tail = *queue->sq_tail;
+    unsigned idx = tail & *queue->sq_mask;
+    struct io_uring_sqe *sqe = &queue->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->read->fd;
+    sqe->off = slot->offset;
+    sqe->addr = (uintptr_t)slot->buf;
+    sqe->len = slot->length;
+    sqe->user_data = slot_idx;
+
+    queue->sq_array[idx] = idx;
+    __atomic_store_n(queue->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queue->in_flight += 1;
+
+    if (!enter_ring(queue, 0))
+        abandon_ring(queue);
+}
+
+// Waits for at least one completion, and handles all that are available.
+// May abandon the ring.
+static void
+reap_completions(struct io_queue *queue)
+{
+    unsigned head = *queue->cq_head;
+
+    while (head == __atomic_load_n(queue->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (!enter_ring(queue, 1)) {
+            abandon_ring(queue);
+            return;
+        }
+    }
+
+    while (head != __atomic_load_n(queue->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &queue->cqes[head & *queue->cq_mask];
+        unsigned slot_idx = cqe->user_data;
+        struct slot *slot = &queue->slots[slot_idx];
+        int res = cqe->res;
+
+        // Consumed right away, as handling may abandon the ring, which then
+        // takes care of the remaining completions.
+        head += 1;
+        __atomic_store_n(queue->cq_head, head, __ATOMIC_RELEASE);
+        queue->in_flight -= 1;
+
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            // Kernel has io_uring, but not IORING_OP_READ (before 5.6). Every
+            // other read would fail the same way.
+            abandon_ring(queue);
+            return;
+        }
+
+        if (res == -EINTR || res == -EAGAIN) {
+            submit_slot(queue, slot_idx);
+            if (queue->ring_fd < 0)
+                return;
+            continue;
+        }
+
+        if (res > 0) {
+            queue->bytes_read += res;
+            if ((uint32_t)res < slot->length) {
+                // Short read. Continue, unless that's the end of the file.
+                slot->offset += res;
+                slot->length -= res;
+                submit_slot(queue, slot_idx);
+                if (queue->ring_fd < 0)
+                    return;
+                continue;
+            }
+        }
+
+        release_slot(queue, slot_idx);
+    }
+}
+
+void
+io_queue_submit(struct io_queue *queue, int fd, uint64_t offset,
+                uint64_t length, io_queue_done_fn done, void *done_arg)
+{
+    if (queue->ring_fd < 0) {
+        queue->bytes_read += read_engine_populate(fd, offset, length);
+        if (done)
+            done(done_arg);
+        return;
+    }
+
+    struct queued_read *read = xmalloc(sizeof(*read));
+    read->fd = fd;
+    read->done = done;
+    read->done_arg = done_arg;
+    read->refcount = 1;
+
+    while (length > 0) {
+        while (queue->ring_fd >= 0 && queue->free_count == 0)
+            reap_completions(queue);
+
+        if (queue->ring_fd < 0) {
+            // Ring was abandoned.
+            queue->bytes_read += read_engine_populate(fd, offset, length);
+            break;
+        }
+
+        unsigned slot_idx = queue->free_slots[--queue->free_count];
+        struct slot *slot = &queue->slots[slot_idx];
+        uint32_t chunk = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+
+        read->refcount += 1;
+        slot->read = read;
+        slot->offset = offset;
+        slot->length = chunk;
+        submit_slot(queue, slot_idx);
+
+        offset += chunk;
+        length -= chunk;
+    }
+
+    unref_queued_read(read);
+}
+
+uint64_t
+io_queue_drain(struct io_queue *queue)
+{
+    while (queue->in_flight > 0)
+        reap_completions(queue);
+
+    uint64_t bytes_read = queue->bytes_read;
+    queue->bytes_read = 0;
+    return bytes_read;
+}
+
+void
+io_queue_free(struct io_queue *queue)
+{
+    if (!queue)
+        return;
+
+    io_queue_drain(queue);
+
+    if (queue->ring_fd >= 0)
+        teardown_ring(queue);
+
+    if (queue->slots) {
+        for (unsigned k = 0; k < queue->depth; k++)
+            free(queue->slots[k].buf);
+        free(queue->slots);
+        free(queue->free_slots);
+    }
+
+    free(queue);
+}
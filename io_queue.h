@@ -0,0 +1,36 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdint.h>
+
+// Keeps several reads in flight, so the disk and the block layer have
+// requests to reorder and merge. Reads are submitted in the order they are
+// queued, which is expected to be the order of physical positions.
+//
+// With the io_uring read engine, up to PRECACHE_QUEUE_DEPTH reads (32 by
+// default) are in flight at once. Other engines, and kernels without
+// io_uring, do each read right away with read_engine_populate().
+struct io_queue;
+
+// Called once a queued read is done.
+typedef void (*io_queue_done_fn)(void *arg);
+
+struct io_queue *
+io_queue_new(void);
+
+// Queues a read of |length| bytes at |offset| of |fd|. |done|, if not NULL,
+// is called with |done_arg| once the read is done, and |fd| is not needed
+// anymore. Blocks while the queue is full.
+void
+io_queue_submit(struct io_queue *queue, int fd, uint64_t offset,
+                uint64_t length, io_queue_done_fn done, void *done_arg);
+
+// Waits for all queued reads. Returns the number of bytes read since the
+// previous call.
+uint64_t
+io_queue_drain(struct io_queue *queue);
+
+void
+io_queue_free(struct io_queue *queue);
@@ -2,22 +2,29 @@
 // SPDX-License-Identifier: MIT
 
 #define _GNU_SOURCE
+#include "detector.h"
+#include "dir_snapshot.h"
 #include "encfs_mapper.h"
 #include "intercepted_functions.h"
 #include "log.h"
 #include "mem.h"
+#include "order.h"
 #include "ut_misc.h"
+#include "utils.h"
+#include "worker.h"
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <linux/fiemap.h>
-#include <linux/fs.h>
+#include <fts.h>
+#include <ftw.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <utarray.h>
 #include <uthash.h>
@@ -43,128 +50,552 @@
         ____mode;                                                              \
     })
 
-enum readdir_tracker_state {
-    RDT_STATE_start = 0,       // Initial state.
-    RDT_STATE_readdir1_open0,  // Seen one readdir.
-    RDT_STATE_readdir1_open1,  // Seen one readdir and one open.
-    RDT_STATE_readdir2_open1,  // Seen two readdir's and one open.
-    RDT_STATE_readdir2_open2,  // Seen two readdir's and two open's.
-    RDT_STATE_readdir3_open2,  // Seen three readdir's and two open's.
-    RDT_STATE_do_precaching,   // Seen three readdir's and three open's. Final
-                               // FSM state. Resolution: do file precaching.
-    RDT_STATE_skip,  // Final FSM state. Resolution: do not do precaching.
+struct dirp_to_state_mapping {
+    UT_hash_handle hh;
+    pthread_mutex_t lock;  // Guards cursor, detector and read-ahead.
+    DIR *dirp;  // NULL for directories walked by fts(3) or nftw(3).
+    char *dirname;
+    dev_t dir_dev;  // Identify the directory for openat() calls relative to
+    ino_t dir_ino;  // directory file descriptors.
+    struct dir_snapshot *snapshot;
+    size_t current_idx;  // Entry to be returned next.
+    bool reached_end;    // Consumer got past the last entry.
+    struct detector detector;
+    struct order_tracker order;  // Open order, if it's not the readdir order.
+    struct precache_stream *precache;  // Read-ahead window, if active.
+    struct stat_prefetch *stat_prefetch;
+    bool subtree_root;                 // |precache| covers subdirectories.
+
+    // Recursive stream of an ancestor directory, which covers this one.
+    // Opened files are reported to it, and there is no own read-ahead.
+    struct precache_stream *subtree;
+    char *subtree_prefix;  // Path relative to that ancestor, with a slash.
+    struct state_bucket *path_bucket;
+    struct state_bucket *inode_bucket;
+
+    // Consumer gets all entries at once, e.g. from scandir(). Each open of an
+    // entry counts as if that entry was just returned by readdir().
+    bool implicit_readdir;
+
+    // Nothing owns the state. Such states are dropped, oldest first, when
+    // there are too many of them, and once they expire.
+    bool detached;
+    uint64_t expires_ms;  // Monotonic time, pushed back by each open.
+    size_t snapshot_bytes;  // Memory the detached state keeps alive.
+
+    struct dirp_to_state_mapping *prev, *next;
+    struct dirp_to_state_mapping *path_prev, *path_next;
+    struct dirp_to_state_mapping *inode_prev, *inode_next;
 };
 
-struct dirent_list {
-    struct dirent *ent;
-    struct dirent_list *prev, *next;
+// Groups states by a key, so an open() finds candidate directories with a
+// single lookup. States are kept in creation order.
+struct state_bucket {
+    UT_hash_handle hh;
+    void *key;
+    size_t key_len;
+    struct dirp_to_state_mapping *states;
 };
 
-struct dirp_to_state_mapping {
-    UT_hash_handle hh;
-    DIR *dirp;
-    char *dirname;
-    struct dirent_list *dirent_list;
-    struct dirent_list *current_dirent;
-    int cached_files_count;
-    enum readdir_tracker_state fsm_state;
+struct inode_key {
+    dev_t dev;
+    ino_t ino;
 };
 
+// States of DIR streams are indexed by the DIR pointer. Every state, including
+// ones not backed by a DIR, is also on the |all_states| list, and is indexed by
+// directory path and by directory inode.
 static struct dirp_to_state_mapping *dirp_to_state_map = NULL;
+static struct dirp_to_state_mapping *all_states = NULL;
+static struct state_bucket *states_by_path = NULL;
+static struct state_bucket *states_by_inode = NULL;
+static size_t tracked_state_count = 0;
+
+// Detached states are not counted in |tracked_state_count|, so they don't
+// keep opens off the fast path for long. Each one is dropped when no file of
+// its directory was opened for DETACHED_STATE_TIMEOUT_MS. Their snapshots may
+// be of huge directories, so memory they keep is limited too.
+#define MAX_DETACHED_STATES 16
+#define MAX_DETACHED_SNAPSHOT_BYTES (64 * 1024 * 1024)
+#define DETACHED_STATE_TIMEOUT_MS 2000
+static size_t detached_state_count = 0;
+static size_t detached_snapshot_bytes = 0;
+static uint64_t detached_states_expire_ms = 0;  // Latest expiry of them all.
+
+// Containers above are guarded by |states_lock|. Lookups take it shared, so
+// threads working with different directories don't wait for each other.
+// Insertions and removals take it exclusive. A state found in a container is
+// then used under its own mutex. Walk trackers own their states, and use them
+// without |states_lock|. No blocking I/O is done while holding either lock,
+// except for reading the directory into the snapshot while readdir() holds the
+// state mutex. States owned by a DIR are only removed by closedir(), so
+// readdir() releases |states_lock| before that. Removed states are freed after
+// |states_lock| is released, as that waits for their snapshots.
+static pthread_rwlock_t states_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Processes to track, from PRECACHE_PROCESSES. Others get libc functions as
+// they are.
+static pthread_once_t tracking_once = PTHREAD_ONCE_INIT;
+static bool tracking_allowed = true;
+
+// 0 disables, 1 stats in background, 2 stats right in opendir().
+static int cfg_stat_prefetch = 0;
+
+// PRECACHE_PROCESSES is a list of program names separated by colons or commas.
+// If it's set, only these programs are tracked. Settings used by opendir() are
+// read here too, so it doesn't parse the environment on every call.
+static void
+init_tracking(void)
+{
+    const char *env_PRECACHE_STAT_PREFETCH = getenv("PRECACHE_STAT_PREFETCH");
+    if (env_PRECACHE_STAT_PREFETCH)
+        cfg_stat_prefetch = atoi(env_PRECACHE_STAT_PREFETCH);
+
+    const char *processes = getenv("PRECACHE_PROCESSES");
+    if (!processes || processes[0] == '\0')
+        return;
+
+    const char *name = program_invocation_short_name;
+    size_t name_len = strlen(name);
+
+    tracking_allowed = false;
+    for (const char *p = processes; *p != '\0';) {
+        size_t len = strcspn(p, ":,");
+        if (len == name_len && memcmp(p, name, len) == 0) {
+            tracking_allowed = true;
+            break;
+        }
+
+        p += len;
+        if (*p != '\0')
+            p++;
+    }
+
+    LOG("%s: tracking of %s is %s", __func__, name,
+        tracking_allowed ? "enabled" : "disabled");
+}
+
+static bool
+tracking_enabled(void)
+{
+    pthread_once(&tracking_once, init_tracking);
+    return tracking_allowed;
+}
+
+// Lets calls skip lookups, and locks, while there are no states at all.
+static bool
+no_states_tracked(void)
+{
+    return __atomic_load_n(&tracked_state_count, __ATOMIC_ACQUIRE) == 0;
+}
+
+static uint64_t
+monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+lock_states_shared(void)
+{
+    pthread_rwlock_rdlock(&states_lock);
+}
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static void
+lock_states_exclusive(void)
+{
+    pthread_rwlock_wrlock(&states_lock);
+}
+
+static void
+unlock_states(void)
+{
+    pthread_rwlock_unlock(&states_lock);
+}
+
+static void
+lock_dstate(struct dirp_to_state_mapping *dstate)
+{
+    pthread_mutex_lock(&dstate->lock);
+}
+
+static void
+unlock_dstate(struct dirp_to_state_mapping *dstate)
+{
+    pthread_mutex_unlock(&dstate->lock);
+}
+
+// Length of |path| without trailing slashes. Paths that differ only in those
+// slashes refer to the same directory.
+static size_t
+path_key_len(const char *path, size_t len)
+{
+    while (len > 0 && path[len - 1] == '/')
+        len--;
+    return len;
+}
+
+static struct state_bucket *
+get_state_bucket(struct state_bucket **index, const void *key, size_t key_len)
+{
+    struct state_bucket *bucket;
+
+    HASH_FIND(hh, *index, key, key_len, bucket);
+    if (bucket)
+        return bucket;
+
+    bucket = xcalloc(1, sizeof(*bucket));
+    bucket->key = xmalloc(key_len > 0 ? key_len : 1);
+    memcpy(bucket->key, key, key_len);
+    bucket->key_len = key_len;
+    HASH_ADD_KEYPTR(hh, *index, bucket->key, bucket->key_len, bucket);
+    return bucket;
+}
+
+static void
+put_state_bucket(struct state_bucket **index, struct state_bucket *bucket)
+{
+    if (bucket->states != NULL)
+        return;
+
+    HASH_DEL(*index, bucket);
+    free(bucket->key);
+    free(bucket);
+}
 
 static void
-lock(void)
+index_dirp_to_state_mapping(struct dirp_to_state_mapping *m)
 {
-    pthread_mutex_lock(&mutex);
+    size_t len = path_key_len(m->dirname, strlen(m->dirname));
+    m->path_bucket = get_state_bucket(&states_by_path, m->dirname, len);
+    DL_APPEND2(m->path_bucket->states, m, path_prev, path_next);
+
+    struct inode_key ikey;
+    memset(&ikey, 0, sizeof(ikey));  // Padding is a part of the key.
+    ikey.dev = m->dir_dev;
+    ikey.ino = m->dir_ino;
+    m->inode_bucket = get_state_bucket(&states_by_inode, &ikey, sizeof(ikey));
+    DL_APPEND2(m->inode_bucket->states, m, inode_prev, inode_next);
 }
 
 static void
-unlock(void)
+unindex_dirp_to_state_mapping(struct dirp_to_state_mapping *m)
 {
-    pthread_mutex_unlock(&mutex);
+    DL_DELETE2(m->path_bucket->states, m, path_prev, path_next);
+    put_state_bucket(&states_by_path, m->path_bucket);
+
+    DL_DELETE2(m->inode_bucket->states, m, inode_prev, inode_next);
+    put_state_bucket(&states_by_inode, m->inode_bucket);
 }
 
 static void
 free_dirp_to_state_mapping(struct dirp_to_state_mapping *m)
 {
+    if (m->precache)
+        precache_stream_close(m->precache);
+    if (m->subtree)
+        precache_stream_unref(m->subtree);
+    if (m->stat_prefetch)
+        stat_prefetch_close(m->stat_prefetch);
+    free(m->subtree_prefix);
+    order_tracker_reset(&m->order);
+    dir_snapshot_finish(m->snapshot, false);
+    dir_snapshot_unref(m->snapshot);
+    pthread_mutex_destroy(&m->lock);
     free(m->dirname);
     free(m);
 }
 
+// Removes |m| from all containers, and moves it to |dropped|. Freeing may
+// wait for a directory read in progress, so states on |dropped| are to be
+// freed with free_dropped_states() once |states_lock| is released. Requires
+// |states_lock| to be held exclusively.
+static void
+forget_dirp_to_state_mapping(struct dirp_to_state_mapping *m,
+                             struct dirp_to_state_mapping **dropped)
+{
+    if (m->dirp)
+        HASH_DEL(dirp_to_state_map, m);
+    if (m->detached) {
+        __atomic_sub_fetch(&detached_state_count, 1, __ATOMIC_RELEASE);
+        detached_snapshot_bytes -= m->snapshot_bytes;
+    } else
+        __atomic_sub_fetch(&tracked_state_count, 1, __ATOMIC_RELEASE);
+    unindex_dirp_to_state_mapping(m);
+    DL_DELETE(all_states, m);
+    DL_APPEND(*dropped, m);
+}
+
 static void
-clear_dirp_to_state_map(void)
+free_dropped_states(struct dirp_to_state_mapping **dropped)
 {
+    while (*dropped) {
+        struct dirp_to_state_mapping *m = *dropped;
+        DL_DELETE(*dropped, m);
+        free_dirp_to_state_mapping(m);
+    }
+}
+
+static void
+clear_dirp_to_state_map(struct dirp_to_state_mapping **dropped)
+{
+    while (all_states)
+        forget_dirp_to_state_mapping(all_states, dropped);
+}
+
+// Requires |states_lock| to be held exclusively.
+static struct dirp_to_state_mapping *
+new_dirp_to_state_mapping(const char *dirname, struct dir_snapshot *snapshot,
+                          dev_t dir_dev, ino_t dir_ino)
+{
+    struct dirp_to_state_mapping *dstate = xcalloc(1, sizeof(*dstate));
+
+    pthread_mutex_init(&dstate->lock, NULL);
+    dstate->dirp = NULL;
+    detector_reset(&dstate->detector);
+    order_tracker_init(&dstate->order);
+    dstate->dirname = xstrdup(dirname);
+    dstate->dir_dev = dir_dev;
+    dstate->dir_ino = dir_ino;
+    dstate->snapshot = snapshot;
+    dstate->current_idx = 0;
+
+    DL_APPEND(all_states, dstate);
+    index_dirp_to_state_mapping(dstate);
+    __atomic_add_fetch(&tracked_state_count, 1, __ATOMIC_RELEASE);
+    return dstate;
+}
+
+// Pushes back expiry of detached state |dstate|, which just saw an open.
+// Requires |dstate| to be locked, and |states_lock| to be held.
+static void
+refresh_detached_state(struct dirp_to_state_mapping *dstate)
+{
+    uint64_t expires_ms = monotonic_ms() + DETACHED_STATE_TIMEOUT_MS;
+    uint64_t latest =
+        __atomic_load_n(&detached_states_expire_ms, __ATOMIC_RELAXED);
+
+    dstate->expires_ms = expires_ms;
+    while (latest < expires_ms &&
+           !__atomic_compare_exchange_n(&detached_states_expire_ms, &latest,
+                                        expires_ms, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))  //
+    {
+    }
+}
+
+// Drops detached states that expired. Requires |states_lock| to be held
+// exclusively.
+static void
+expire_detached_states(struct dirp_to_state_mapping **dropped)
+{
+    uint64_t now = monotonic_ms();
     struct dirp_to_state_mapping *it, *tmp;
-    HASH_ITER (hh, dirp_to_state_map, it, tmp) {
-        HASH_DEL(dirp_to_state_map, it);
-        free_dirp_to_state_mapping(it);
+
+    DL_FOREACH_SAFE (all_states, it, tmp) {
+        if (!it->detached)
+            continue;
+
+        // Expiry is only changed under the state mutex.
+        lock_dstate(it);
+        bool expired = it->expires_ms <= now;
+        unlock_dstate(it);
+
+        if (expired) {
+            LOG("%s: dropping detached state of %s", __func__, it->dirname);
+            forget_dirp_to_state_mapping(it, dropped);
+        }
+    }
+}
+
+// Lets opens take the fast path once detached states are gone. Returns true
+// if there are detached states left.
+static bool
+detached_states_alive(void)
+{
+    if (__atomic_load_n(&detached_state_count, __ATOMIC_ACQUIRE) == 0)
+        return false;
+
+    if (monotonic_ms() <
+        __atomic_load_n(&detached_states_expire_ms, __ATOMIC_RELAXED))
+    {
+        // At least one of them is still alive.
+        return true;
     }
+
+    struct dirp_to_state_mapping *dropped = NULL;
+    lock_states_exclusive();
+    expire_detached_states(&dropped);
+    unlock_states();
+    free_dropped_states(&dropped);
+
+    return __atomic_load_n(&detached_state_count, __ATOMIC_ACQUIRE) > 0;
 }
 
+// Requires |states_lock| to be held exclusively.
 static void
-drain_dirent_list(struct dirp_to_state_mapping *dstate)
+detach_dirp_to_state_mapping(struct dirp_to_state_mapping *dstate,
+                             struct dirp_to_state_mapping **dropped)
 {
-    while (dstate->dirent_list) {
-        struct dirent_list *li = dstate->dirent_list;
+    expire_detached_states(dropped);
+
+    size_t snapshot_bytes = dir_snapshot_memory(dstate->snapshot);
+    if (snapshot_bytes > MAX_DETACHED_SNAPSHOT_BYTES) {
+        LOG("%s: not keeping %s, its snapshot is too large", __func__,
+            dstate->dirname);
+        forget_dirp_to_state_mapping(dstate, dropped);
+        return;
+    }
 
-        DL_DELETE(dstate->dirent_list, li);
-        free(li->ent);
-        free(li);
+    while (detached_state_count >= MAX_DETACHED_STATES ||
+           detached_snapshot_bytes + snapshot_bytes >
+               MAX_DETACHED_SNAPSHOT_BYTES)  //
+    {
+        struct dirp_to_state_mapping *it;
+
+        // List is in creation order, so the first one found is the oldest.
+        DL_FOREACH (all_states, it) {
+            if (it->detached)
+                break;
+        }
+        forget_dirp_to_state_mapping(it, dropped);
     }
+
+    lock_dstate(dstate);
+    refresh_detached_state(dstate);
+    unlock_dstate(dstate);
+
+    dstate->detached = true;
+    dstate->snapshot_bytes = snapshot_bytes;
+    detached_snapshot_bytes += snapshot_bytes;
+    __atomic_sub_fetch(&tracked_state_count, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&detached_state_count, 1, __ATOMIC_RELEASE);
 }
 
+// Drops detached states of directory |dirname|. They are superseded by a new
+// state for the same directory. Requires |states_lock| to be held
+// exclusively.
 static void
-populate_dirent_list(struct dirp_to_state_mapping *dstate)
+forget_detached_states(const char *dirname,
+                       struct dirp_to_state_mapping **dropped)
 {
-    struct dirent *de;
+    struct state_bucket *bucket;
+    size_t len = path_key_len(dirname, strlen(dirname));
 
-    while ((de = real_readdir(dstate->dirp))) {
-        void *mem = xmalloc(de->d_reclen);
-        struct dirent_list *li = xmalloc(sizeof(*li));
+    HASH_FIND(hh, states_by_path, dirname, len, bucket);
+    if (!bucket)
+        return;
 
-        memcpy(mem, de, de->d_reclen);
-        li->ent = mem;
-        DL_APPEND(dstate->dirent_list, li);
+    // Removing the last state frees the bucket, so it's not touched after
+    // the loop starts.
+    struct dirp_to_state_mapping *it = bucket->states;
+    while (it) {
+        struct dirp_to_state_mapping *next = it->path_next;
+        if (it->detached)
+            forget_dirp_to_state_mapping(it, dropped);
+        it = next;
     }
+}
+
+// Links |dstate| to the recursive stream of the closest ancestor directory, if
+// there is one. Requires |states_lock| to be held.
+static void
+link_to_subtree(struct dirp_to_state_mapping *dstate)
+{
+    const char *dirname = dstate->dirname;
+    size_t end = path_key_len(dirname, strlen(dirname));
+    size_t len = end;
+
+    while (len > 0) {
+        while (len > 0 && dirname[len - 1] != '/')
+            len--;
+        if (len == 0)
+            break;
+
+        size_t rel_start = len;
+        len = path_key_len(dirname, len);
+
+        struct state_bucket *bucket;
+        HASH_FIND(hh, states_by_path, dirname, len, bucket);
+        if (!bucket)
+            continue;
+
+        struct dirp_to_state_mapping *ancestor;
+        DL_FOREACH2 (bucket->states, ancestor, path_next) {
+            lock_dstate(ancestor);
+
+            struct precache_stream *stream = NULL;
+            const char *base = "";
+            if (ancestor->subtree_root && ancestor->precache) {
+                stream = ancestor->precache;
+            } else if (ancestor->subtree) {
+                stream = ancestor->subtree;
+                base = ancestor->subtree_prefix;
+            }
+
+            if (stream) {
+                UT_string prefix;
+                utstring_init(&prefix);
+                utstring_printf(&prefix, "%s%.*s/", base,
+                                (int)(end - rel_start), dirname + rel_start);
+                dstate->subtree = precache_stream_ref(stream);
+                dstate->subtree_prefix = utstring_steal_data(&prefix);
+            }
 
-    dstate->current_dirent = dstate->dirent_list;
+            unlock_dstate(ancestor);
+            if (stream) {
+                LOG("%s: %s follows subtree read-ahead as %s", __func__,
+                    dirname, dstate->subtree_prefix);
+                return;
+            }
+        }
+
+        // Closest ancestor that is being read doesn't cover its subtree.
+        return;
+    }
 }
 
 static void
 handle_opendir(const char *dirname, DIR *dirp)
 {
     struct dirp_to_state_mapping *dstate = NULL;
+    struct dirp_to_state_mapping *dropped = NULL;
 
-    if (!dirp)
+    if (!dirp || !tracking_enabled())
         return;
 
-    lock();
-    encfs_mapper_refresh_mounts(dirname);
+    // The only system call here. Directory is read lazily, and mounts are
+    // checked by the worker once there is something to read.
+    struct stat sb = {};
+    fstat(dirfd(dirp), &sb);
+
+    struct dir_snapshot *snapshot = dir_snapshot_new(dirname, dirp);
+
+    struct stat_prefetch *stat_prefetch = NULL;
+    if (cfg_stat_prefetch > 0)
+        stat_prefetch = stat_prefetch_new(snapshot, cfg_stat_prefetch > 1);
+
+    lock_states_exclusive();
+    if (detached_state_count > 0)
+        forget_detached_states(dirname, &dropped);
 
     HASH_FIND_PTR(dirp_to_state_map, &dirp, dstate);
     if (dstate) {
         // TODO: this is an error state. Hashtable should have no records for
         // this particular 'dirp'.
-        HASH_DEL(dirp_to_state_map, dstate);
-        free_dirp_to_state_mapping(dstate);
+        forget_dirp_to_state_mapping(dstate, &dropped);
     }
 
-    dstate = xcalloc(1, sizeof(*dstate));
-
+    dstate = new_dirp_to_state_mapping(dirname, snapshot, sb.st_dev, sb.st_ino);
     dstate->dirp = dirp;
-    dstate->dirent_list = NULL;
-    dstate->current_dirent = NULL;
-    dstate->cached_files_count = 0;
-    dstate->fsm_state = RDT_STATE_start;
-    dstate->dirname = xstrdup(dirname);
-
-    populate_dirent_list(dstate);
-
+    dstate->stat_prefetch = stat_prefetch;
     HASH_ADD_PTR(dirp_to_state_map, dirp, dstate);
+    link_to_subtree(dstate);
+    unlock_states();
 
-    unlock();
+    free_dropped_states(&dropped);
 }
 
 PRECACHE_EXPORT
@@ -179,35 +610,46 @@ opendir(const char *name)
     return dirp;
 }
 
-struct sort_array_entry {
-    char *file_name;
-    uint64_t physical_pos;
-    uint64_t file_offset;
-    uint64_t extent_length;
-};
-
-static int
-sort_array_comparator(const void *a, const void *b)
+PRECACHE_EXPORT
+DIR *
+fdopendir(int fd)
 {
-    const struct sort_array_entry *a_ = a;
-    const struct sort_array_entry *b_ = b;
+    ensure_initialized();
+    LOG("%s: fd=%d", __func__, fd);
+
+    DIR *dirp = real_fdopendir(fd);
+    if (!dirp)
+        return NULL;
+
+    // Directory name is needed to construct paths of the files inside.
+    char *dirname = get_fd_path(fd);
+    if (dirname) {
+        handle_opendir(dirname, dirp);
+        free(dirname);
+    }
 
-    return (a_->physical_pos < b_->physical_pos)
-               ? -1
-               : (a_->physical_pos > b_->physical_pos);
+    return dirp;
 }
 
 static void
-sort_array_entry_dtor(void *a)
+stop_precaching(struct dirp_to_state_mapping *dstate)
 {
-    struct sort_array_entry *a_ = a;
-    free(a_->file_name);
+    if (dstate->precache) {
+        precache_stream_close(dstate->precache);
+        dstate->precache = NULL;
+        dstate->subtree_root = false;
+    }
 }
 
+// Moves the read-ahead window so it starts at |cursor_idx|, the entry consumer
+// is currently at. Window is created on first call.
 static void
-cache_files(struct dirp_to_state_mapping *dstate)
+advance_precaching(struct dirp_to_state_mapping *dstate, size_t cursor_idx)
 {
-    LOG("%s>", __func__);
+    if (dstate->precache) {
+        precache_stream_advance(dstate->precache, cursor_idx);
+        return;
+    }
 
     bool cfg_call_sync = true;
     const char *env_PRECACHE_SYNC = getenv("PRECACHE_SYNC");
@@ -219,154 +661,108 @@ cache_files(struct dirp_to_state_mapping *dstate)
     if (env_PRECACHE_LIMIT)
         cfg_cache_limit = atol(env_PRECACHE_LIMIT);
 
-    bool syncfs_was_invoked = false;
-
-    size_t size_so_far = 0;
-    size_t count = 0;
-    UT_string fname;
-    uint32_t extent_buffer_elements = 1000;
-    struct fiemap *fiemap = NULL;
-    UT_array sort_array;
-    UT_icd sort_array_icd = {sizeof(struct sort_array_entry), NULL, NULL,
-                             sort_array_entry_dtor};
+    size_t cfg_window_files = 1024;
+    const char *env_PRECACHE_WINDOW_FILES = getenv("PRECACHE_WINDOW_FILES");
+    if (env_PRECACHE_WINDOW_FILES)
+        cfg_window_files = atol(env_PRECACHE_WINDOW_FILES);
+
+    bool cfg_recursive = false;
+    const char *env_PRECACHE_RECURSIVE = getenv("PRECACHE_RECURSIVE");
+    if (env_PRECACHE_RECURSIVE)
+        cfg_recursive = atol(env_PRECACHE_RECURSIVE) != 0;
+
+    if (dstate->order.ordered) {
+        dstate->precache = precache_stream_new(
+            dstate->order.ordered, dstate->order.cursor_idx, cfg_cache_limit,
+            cfg_window_files, cfg_call_sync, false);
+        LOG("%s: started read-ahead window in inferred order at %zu",
+            __func__, dstate->order.cursor_idx);
+        return;
+    }
 
-    utstring_init(&fname);
-    utarray_init(&sort_array, &sort_array_icd);
+    // Consumers copying a tree with readdir() descend into subdirectories as
+    // they get to them. Walkers look ahead on their own.
+    dstate->subtree_root = cfg_recursive && dstate->dirp != NULL;
+    dstate->precache = precache_stream_new(
+        dstate->snapshot, dstate->current_idx, cfg_cache_limit,
+        cfg_window_files, cfg_call_sync, dstate->subtree_root);
+    LOG("%s: started %sread-ahead window at %zu", __func__,
+        dstate->subtree_root ? "recursive " : "", dstate->current_idx);
+}
 
-    // Valgrind currently doesn't know about FIEMAP ioctls.
-    fiemap = xcalloc(1, sizeof(struct fiemap) + sizeof(struct fiemap_extent) *
-                                                    extent_buffer_elements);
+static bool
+seek_to_name(struct dirp_to_state_mapping *dstate, const char *name)
+{
+    struct dir_snapshot *snapshot = dstate->snapshot;
+    struct dirent *de;
+    size_t idx;
 
-    LOG("%s: preparing file list", __func__);
-    for (struct dirent_list *it = dstate->current_dirent; it != NULL;
-         it = it->next, count++)  //
+    // Entries are usually consumed in order, so the name is right at the
+    // cursor.
+    for (idx = dstate->current_idx;
+         (de = dir_snapshot_entry(snapshot, idx)) != NULL; idx++)  //
     {
-        struct stat sb;
-
-        if (strcmp(it->ent->d_name, ".") == 0 ||
-            strcmp(it->ent->d_name, "..") == 0)  //
-        {
-            continue;
-        }
-
-        utstring_clear(&fname);
-        utstring_printf(&fname, "%s/%s", dstate->dirname, it->ent->d_name);
-        char *resolved_path = encfs_mapper_resolve_path(utstring_body(&fname));
-        LOG("%s: unsorted, path=%s", __func__, utstring_body(&fname));
-        LOG("%s: unsorted, resolved-path=%s", __func__, resolved_path);
-        if (!resolved_path)
-            break;
-
-        int fd = real_open(resolved_path, O_RDONLY);
-        if (fd < 0) {
-            free(resolved_path);
-            continue;
-        }
-
-        if (cfg_call_sync && !syncfs_was_invoked) {
-            syncfs(fd);
-            syncfs_was_invoked = true;
-        }
-
-        int res = fstat(fd, &sb);
-        if (res != 0) {
-            free(resolved_path);
-            close(fd);
-            break;
-        }
-
-        if (size_so_far + sb.st_size > cfg_cache_limit) {
-            free(resolved_path);
-            close(fd);
-            break;
-        }
-
-        size_so_far += sb.st_size;
+        if (strcmp(de->d_name, name) == 0)
+            goto found;
+    }
 
-        uint64_t pos = 0;
-        bool last_extent_seen = false;
-        while (pos < (uint64_t)sb.st_size && !last_extent_seen) {
-            memset(fiemap, 0, sizeof(struct fiemap));
-            fiemap->fm_start = pos;
-            fiemap->fm_length = UINT64_MAX;
-            fiemap->fm_flags = 0;
-            fiemap->fm_extent_count = extent_buffer_elements;
+    for (idx = 0; idx < dstate->current_idx &&
+                  (de = dir_snapshot_entry(snapshot, idx)) != NULL;
+         idx++)  //
+    {
+        if (strcmp(de->d_name, name) == 0)
+            goto found;
+    }
 
-            int ioctl_res = ioctl(fd, FS_IOC_FIEMAP, fiemap);
-            if (ioctl_res != 0)
-                break;
+    return false;
 
-            for (uint32_t idx = 0; idx < fiemap->fm_mapped_extents; idx++) {
-                struct fiemap_extent *ext = &fiemap->fm_extents[idx];
-
-                pos = ext->fe_logical + ext->fe_length;
-                if (ext->fe_flags & FIEMAP_EXTENT_LAST)
-                    last_extent_seen = true;
-
-                if (ext->fe_logical <= (uint64_t)sb.st_size) {
-                    // Reduce .fe_length to match file size.
-                    if (ext->fe_logical + ext->fe_length > (uint64_t)sb.st_size)
-                        ext->fe_length = sb.st_size - ext->fe_logical;
-                }
-
-                struct sort_array_entry sae = {
-                    .file_name = xstrdup(resolved_path),
-                    .physical_pos = ext->fe_physical,
-                    .file_offset = ext->fe_logical,
-                    .extent_length = ext->fe_length,
-                };
-
-                utarray_push_back(&sort_array, &sae);
-                LOG("%s: unsorted segment (%8zu, %7zu) path=%s", __func__,
-                    sae.physical_pos, sae.extent_length, sae.file_name);
-            }
-        }
+found:
+    dstate->current_idx = idx;
+    return true;
+}
 
-        free(resolved_path);
-        close(fd);
+// Starts, moves, or stops the read-ahead window after the detector has seen
+// an event. |cursor_idx| is the entry consumer is at.
+static void
+update_precaching(struct dirp_to_state_mapping *dstate, size_t cursor_idx)
+{
+    if (dstate->order.ordered || dstate->subtree) {
+        // Window follows the inferred order, or is maintained by an ancestor.
+        return;
     }
 
-    dstate->cached_files_count = count;
-    LOG("%s: cached_files_count=%zu", __func__, count);
+    if (dstate->detector.confirmed)
+        advance_precaching(dstate, cursor_idx);
+    else
+        stop_precaching(dstate);
+}
 
-    if (utarray_len(&sort_array) > 0)
-        utarray_sort(&sort_array, sort_array_comparator);
+// Returns the entry at the cursor, moves the cursor forward, and feeds the
+// event to the bulk reading detector.
+static struct dirent *
+return_current_entry(struct dirp_to_state_mapping *dstate)
+{
+    struct dirent *res =
+        dir_snapshot_entry(dstate->snapshot, dstate->current_idx);
+    if (!res) {
+        // Nothing left on the list.
+        dstate->reached_end = true;
+        return NULL;
+    }
 
-    // Actual reading of the files.
-    struct sort_array_entry *sa = utarray_front(&sort_array);
-    for (size_t k = 0; k < utarray_len(&sort_array); k++) {
-        LOG("%s: sorted segment (%8zu, %7zu) path=%s", __func__,
-            sa[k].physical_pos, sa[k].extent_length, sa[k].file_name);
-        int fd = real_open(sa[k].file_name, O_RDONLY);
-        if (fd < 0)
-            continue;
+    const char *d_name = res->d_name;
+    LOG("%s:   d_name=%s", __func__, d_name);
 
-        static char buf[512 * 1024];
-        ssize_t to_read = sa[k].extent_length;
-        off_t ofs = sa[k].file_offset;
-        while (to_read > 0) {
-            ssize_t chunk_sz =
-                to_read < (ssize_t)sizeof(buf) ? to_read : (ssize_t)sizeof(buf);
-            ssize_t bytes_read = pread(fd, buf, chunk_sz, ofs);
-            if (bytes_read == -1 && errno == EINTR) {
-                // Try again.
-                continue;
-            }
-            if (bytes_read <= 0) {
-                // Either an error (-1) or an EOF (0).
-                break;
-            }
-            to_read -= bytes_read;
-            ofs += bytes_read;
-        }
-        close(fd);
-    }
+    if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0)
+        goto done;
 
-    free(fiemap);
+    detector_readdir(&dstate->detector, d_name, res->d_type,
+                     dstate->current_idx);
+    update_precaching(dstate, dstate->current_idx);
 
-    utstring_done(&fname);
-    utarray_done(&sort_array);
-    LOG("%s: returning", __func__);
+done:
+    dstate->current_idx += 1;
+    return res;
 }
 
 PRECACHE_EXPORT
@@ -379,72 +775,22 @@ readdir(DIR *dirp)
     LOG("%s: dirp=%p", __func__, dirp);
     ensure_initialized();
 
-    lock();
+    if (no_states_tracked())
+        return real_readdir(dirp);
+
+    lock_states_shared();
     HASH_FIND_PTR(dirp_to_state_map, &dirp, dstate);
     if (!dstate) {
-        // This should not happen: no record of this DIR instance. Which means
-        // this DIR wasn't read in full yet. Forwarding to real_readdir() may
-        // help.
-
-        res = real_readdir(dirp);
-        unlock();
-        return res;
-    }
-
-    if (dstate->current_dirent == NULL) {
-        // Nothing left on the list.
-        res = NULL;
-        goto done;
-    }
-
-    res = dstate->current_dirent->ent;
-    const char *d_name = dstate->current_dirent->ent->d_name;
-    LOG("%s:   d_name=%s", __func__, d_name);
-
-    if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0)
-        goto done;
-
-    if (dstate->fsm_state == RDT_STATE_do_precaching &&
-        dstate->cached_files_count == 0)  //
-    {
-        LOG("%s:   caching...", __func__);
-        cache_files(dstate);
-        LOG("%s:   cached %d files", __func__, dstate->cached_files_count);
-    }
-
-    if (dstate->cached_files_count > 0)
-        dstate->cached_files_count -= 1;
-
-    switch (dstate->fsm_state) {
-    case RDT_STATE_start:
-        dstate->fsm_state = RDT_STATE_readdir1_open0;
-        break;
-    case RDT_STATE_readdir1_open0:
-        dstate->fsm_state = RDT_STATE_skip;
-        break;
-    case RDT_STATE_readdir1_open1:
-        dstate->fsm_state = RDT_STATE_readdir2_open1;
-        break;
-    case RDT_STATE_readdir2_open1:
-        dstate->fsm_state = RDT_STATE_skip;
-        break;
-    case RDT_STATE_readdir2_open2:
-        dstate->fsm_state = RDT_STATE_readdir3_open2;
-        break;
-    case RDT_STATE_readdir3_open2:
-        dstate->fsm_state = RDT_STATE_skip;
-        break;
-    case RDT_STATE_do_precaching:
-    case RDT_STATE_skip:
-    default:
-        break;
+        // DIR is not tracked, e.g. it was opened before the library was
+        // loaded.
+        unlock_states();
+        return real_readdir(dirp);
     }
 
-done:
-    if (dstate->current_dirent)
-        dstate->current_dirent = dstate->current_dirent->next;
-
-    unlock();
+    lock_dstate(dstate);
+    unlock_states();
+    res = return_current_entry(dstate);
+    unlock_dstate(dstate);
 
     return res;
 }
@@ -459,53 +805,224 @@ readdir64(DIR *dirp)
     return (struct dirent64 *)readdir(dirp);
 }
 
-static void
-handle_closedir(DIR *dirp)
+static int
+do_readdir_r(DIR *dirp, struct dirent *entry, struct dirent **result)
 {
-    lock();
     struct dirp_to_state_mapping *dstate = NULL;
+
+    ensure_initialized();
+
+    if (no_states_tracked())
+        return real_readdir_r(dirp, entry, result);
+
+    lock_states_shared();
     HASH_FIND_PTR(dirp_to_state_map, &dirp, dstate);
-    if (dstate) {
-        HASH_DEL(dirp_to_state_map, dstate);
-        drain_dirent_list(dstate);
-        free_dirp_to_state_mapping(dstate);
+    if (!dstate) {
+        unlock_states();
+        return real_readdir_r(dirp, entry, result);
+    }
+
+    lock_dstate(dstate);
+    unlock_states();
+    struct dirent *de = return_current_entry(dstate);
+    if (de) {
+        memcpy(entry, de,
+               offsetof(struct dirent, d_name) + strlen(de->d_name) + 1);
+        *result = entry;
+    } else {
+        *result = NULL;
     }
+    unlock_dstate(dstate);
 
-    unlock();
+    return 0;
 }
 
 PRECACHE_EXPORT
 int
-closedir(DIR *dirp)
+readdir_r(DIR *dirp, struct dirent *entry, struct dirent **result)
 {
-    ensure_initialized();
     LOG("%s: dirp=%p", __func__, dirp);
+    return do_readdir_r(dirp, entry, result);
+}
 
-    int res = real_closedir(dirp);
-    handle_closedir(dirp);
-
-    return res;
+PRECACHE_EXPORT
+int
+readdir64_r(DIR *dirp, struct dirent64 *entry, struct dirent64 **result)
+{
+    LOG("%s: dirp=%p", __func__, dirp);
+    // Same layout, see readdir64().
+    return do_readdir_r(dirp, (struct dirent *)entry, (struct dirent **)result);
 }
 
 static void
-handle_rewinddir(DIR *dirp)
+handle_closedir(DIR *dirp)
 {
-    struct dirp_to_state_mapping *dstate = NULL;
+    struct dirp_to_state_mapping *dropped = NULL;
+
+    if (no_states_tracked())
+        return;
 
-    lock();
+    lock_states_exclusive();
+    struct dirp_to_state_mapping *dstate = NULL;
     HASH_FIND_PTR(dirp_to_state_map, &dirp, dstate);
     if (!dstate)
         goto done;
 
-    // Calling rewinddir is similar to calling a separate opendir. Everything
-    // starts over, so the state is also reset.
-    dstate->fsm_state = RDT_STATE_start;
-
+    // Consumer that read everything without opening files as it went may
+    // open them later, e.g. after sorting names. State is kept for a while to
+    // learn that order.
+    if (dstate->reached_end && !dstate->detector.confirmed &&
+        !dstate->order.ordered && !dstate->subtree)  //
+    {
+        HASH_DEL(dirp_to_state_map, dstate);
+        dstate->dirp = NULL;
+        stop_precaching(dstate);
+        detach_dirp_to_state_mapping(dstate, &dropped);
+        goto done;
+    }
+
+    forget_dirp_to_state_mapping(dstate, &dropped);
+
+done:
+    unlock_states();
+    free_dropped_states(&dropped);
+}
+
+PRECACHE_EXPORT
+int
+closedir(DIR *dirp)
+{
+    ensure_initialized();
+    LOG("%s: dirp=%p", __func__, dirp);
+
+    // State is dropped first. Once the DIR is freed, another thread may get
+    // the same pointer from opendir().
+    handle_closedir(dirp);
+    return real_closedir(dirp);
+}
+
+// scandir() consumers open entries in the order of the returned array, which
+// is filtered and sorted. The array becomes the entry list of a detached state.
+static void
+handle_scandirat(int dirfd, const char *dirp, struct dirent **namelist, int n)
+{
+    if (n <= 0 || !tracking_enabled())
+        return;
+
+    char *dirname = NULL;
+    if (dirfd == AT_FDCWD || dirp[0] == '/') {
+        dirname = xstrdup(dirp);
+    } else {
+        char *dirfd_path = get_fd_path(dirfd);
+        if (!dirfd_path)
+            return;
+
+        UT_string tmp;
+        utstring_init(&tmp);
+        utstring_printf(&tmp, "%s/%s", dirfd_path, dirp);
+        dirname = utstring_steal_data(&tmp);
+        free(dirfd_path);
+    }
+
+    struct stat sb = {};
+    fstatat(dirfd, dirp, &sb, 0);
+
+    struct dir_snapshot *snapshot = dir_snapshot_new_empty(dirname);
+    for (int k = 0; k < n; k++) {
+        dir_snapshot_append(snapshot, namelist[k]->d_ino, namelist[k]->d_type,
+                            namelist[k]->d_name);
+    }
+
+    struct dirp_to_state_mapping *dropped = NULL;
+    lock_states_exclusive();
+
+    // Repeated scans of the same directory replace each other.
+    forget_detached_states(dirname, &dropped);
+
+    struct dirp_to_state_mapping *dstate =
+        new_dirp_to_state_mapping(dirname, snapshot, sb.st_dev, sb.st_ino);
+    dstate->implicit_readdir = true;
+    detach_dirp_to_state_mapping(dstate, &dropped);
+    unlock_states();
+    free_dropped_states(&dropped);
+
+    free(dirname);
+}
+
+typedef int (*scandir_filter_t)(const struct dirent *);
+typedef int (*scandir_compar_t)(const struct dirent **, const struct dirent **);
+
+PRECACHE_EXPORT
+int
+scandirat(int dirfd, const char *dirp, struct dirent ***namelist,
+          scandir_filter_t filter, scandir_compar_t compar)
+{
+    ensure_initialized();
+    LOG("%s: dirfd=%d, dirp=%s", __func__, dirfd, dirp);
+
+    int n = real_scandirat(dirfd, dirp, namelist, filter, compar);
+    int saved_errno = errno;
+    handle_scandirat(dirfd, dirp, *namelist, n);
+    errno = saved_errno;
+    return n;
+}
+
+PRECACHE_EXPORT
+int
+scandir(const char *dirp, struct dirent ***namelist, scandir_filter_t filter,
+        scandir_compar_t compar)
+{
+    return scandirat(AT_FDCWD, dirp, namelist, filter, compar);
+}
+
+PRECACHE_EXPORT
+int
+scandirat64(int dirfd, const char *dirp, struct dirent64 ***namelist,
+            int (*filter)(const struct dirent64 *),
+            int (*compar)(const struct dirent64 **, const struct dirent64 **))
+{
+    // Same layout, see readdir64().
+    return scandirat(dirfd, dirp, (struct dirent ***)namelist,
+                     (scandir_filter_t)filter, (scandir_compar_t)compar);
+}
+
+PRECACHE_EXPORT
+int
+scandir64(const char *dirp, struct dirent64 ***namelist,
+          int (*filter)(const struct dirent64 *),
+          int (*compar)(const struct dirent64 **, const struct dirent64 **))
+{
+    return scandirat64(AT_FDCWD, dirp, namelist, filter, compar);
+}
+
+static void
+handle_rewinddir(DIR *dirp)
+{
+    struct dirp_to_state_mapping *dstate = NULL;
+
+    if (no_states_tracked())
+        return;
+
+    lock_states_shared();
+    HASH_FIND_PTR(dirp_to_state_map, &dirp, dstate);
+    if (!dstate)
+        goto done;
+
+    lock_dstate(dstate);
+
+    // Calling rewinddir is similar to calling a separate opendir. Everything
+    // starts over, so the state is also reset.
+    detector_reset(&dstate->detector);
+    order_tracker_reset(&dstate->order);
+
     // Start from the beginning of the list.
-    dstate->current_dirent = dstate->dirent_list;
+    dstate->current_idx = 0;
+    dstate->reached_end = false;
+    stop_precaching(dstate);
+    unlock_dstate(dstate);
 
 done:
-    unlock();
+    unlock_states();
 }
 
 PRECACHE_EXPORT
@@ -519,59 +1036,202 @@ rewinddir(DIR *dirp)
     handle_rewinddir(dirp);
 }
 
+// Consumer opened file |name| in the directory. Returns true if enough opens
+// out of readdir order were seen to infer their order.
+static bool
+track_open(struct dirp_to_state_mapping *dstate, const char *name)
+{
+    bool was_confirmed = dstate->detector.confirmed;
+    size_t idx;
+
+    if (dstate->subtree) {
+        UT_string path;
+        utstring_init(&path);
+        utstring_printf(&path, "%s%s", dstate->subtree_prefix, name);
+        precache_stream_advance_path(dstate->subtree, utstring_body(&path));
+        utstring_done(&path);
+        return false;
+    }
+
+    if (dstate->order.ordered) {
+        if (order_tracker_open(&dstate->order, name, &idx))
+            advance_precaching(dstate, idx);
+        else if (!dstate->order.ordered)
+            stop_precaching(dstate);
+        return false;
+    }
+
+    if (detector_open(&dstate->detector, name, &idx)) {
+        // Opened file is still needed.
+        update_precaching(dstate, idx);
+        if (!was_confirmed && dstate->detector.confirmed) {
+            LOG("%s: bulk reading detected in %s", __func__, dstate->dirname);
+        }
+        return false;
+    }
+
+    if (dstate->detector.confirmed)
+        return false;
+
+    stop_precaching(dstate);
+    return order_tracker_add_sample(&dstate->order, name);
+}
+
+static struct dirp_to_state_mapping *
+find_dstate_by_path(const char *fname)
+{
+    // Only files directly inside a directory are tracked, so the directory is
+    // everything before the last slash.
+    const char *slash = strrchr(fname, '/');
+    if (slash == NULL || slash[1] == '\0')
+        return NULL;
+
+    size_t len = path_key_len(fname, slash - fname);
+    struct state_bucket *bucket;
+    HASH_FIND(hh, states_by_path, fname, len, bucket);
+
+    // There could be multiple simultaneously active opendir's for the same
+    // directory, so multiple matches are possible. Currenly, all but first
+    // seen one are ignored.
+    // TODO: handling multiple opendir's for the same directory?
+    return bucket ? bucket->states : NULL;
+}
+
+static struct dirp_to_state_mapping *
+find_dstate_by_inode(const struct inode_key *ikey)
+{
+    struct state_bucket *bucket;
+    HASH_FIND(hh, states_by_inode, ikey, sizeof(*ikey), bucket);
+    return bucket ? bucket->states : NULL;
+}
+
+// Looks up by |ikey| of the directory, if it's known, and by path otherwise.
+// Requires |states_lock| to be held.
+static struct dirp_to_state_mapping *
+find_dstate_for_open(const char *fname, const struct inode_key *ikey)
+{
+    if (ikey->ino != 0)
+        return find_dstate_by_inode(ikey);
+    else
+        return find_dstate_by_path(fname);
+}
+
+// Open a sample was taken at, to find the state again once its order is
+// inferred.
+struct open_order_target {
+    char *fname;
+    struct inode_key ikey;
+};
+
+// Makes the read-ahead window follow the order inferred by the worker thread
+// from a sample of opens. Inference may stat every entry, so it's not done in
+// open(), and the state is looked up again.
+static void
+apply_open_order(void *arg, struct dir_snapshot *snapshot,
+                 struct dir_snapshot *ordered, size_t last_idx)
+{
+    struct open_order_target *target = arg;
+
+    lock_states_shared();
+    struct dirp_to_state_mapping *dstate =
+        find_dstate_for_open(target->fname, &target->ikey);
+
+    // Snapshot reference is held, so it can't be a different state.
+    if (!dstate || dstate->snapshot != snapshot) {
+        dir_snapshot_unref(ordered);
+        goto done;
+    }
+
+    lock_dstate(dstate);
+    if (ordered) {
+        LOG("%s: inferred open order in %s", __func__, dstate->dirname);
+        stop_precaching(dstate);
+    }
+    order_tracker_set(&dstate->order, ordered, last_idx);
+    if (ordered)
+        advance_precaching(dstate, last_idx);
+    unlock_dstate(dstate);
+
+done:
+    unlock_states();
+    free(target->fname);
+    free(target);
+}
+
 static void
 handle_openat(int atfd, const char *fname)
 {
-    size_t fname_len = strlen(fname);
-    if (atfd != AT_FDCWD) {
-        // TODO: handle (atfd!=AT_FDCWD) case.
+    struct dirp_to_state_mapping *dstate;
+    struct inode_key ikey = {0};
+
+    if (no_states_tracked() && !detached_states_alive()) {
+        // Nothing is tracked.
         return;
     }
 
-    for (struct dirp_to_state_mapping *it = dirp_to_state_map; it != NULL;
-         it = it->hh.next)  //
-    {
-        // Path must begin with a stored directory name while the remaining
-        // part should contain no slashes. That is true only for files in that
-        // directory, but not for files deeper in hierarchy.
-        size_t dirname_len = strlen(it->dirname);
-        bool match = fname_len > dirname_len + 1 &&
-                     strncmp(fname, it->dirname, dirname_len) == 0 &&
-                     strchr(fname + dirname_len + 1, '/') == NULL;
-
-        if (!match)
-            continue;
+    // Absolute paths, and paths relative to the current directory, are
+    // matched by their directory part. Other paths are matched by the inode of
+    // their directory, resolved against |atfd|. Bare names relative to the
+    // current directory are typical for tree walkers that change directories.
+    const char *slash = strrchr(fname, '/');
+    if (slash != NULL && slash[1] == '\0')
+        return;
 
-        switch (it->fsm_state) {
-        case RDT_STATE_start:
-            it->fsm_state = RDT_STATE_skip;
-            break;
-        case RDT_STATE_readdir1_open0:
-            it->fsm_state = RDT_STATE_readdir1_open1;
-            break;
-        case RDT_STATE_readdir1_open1:
-            it->fsm_state = RDT_STATE_skip;
-            break;
-        case RDT_STATE_readdir2_open1:
-            it->fsm_state = RDT_STATE_readdir2_open2;
-            break;
-        case RDT_STATE_readdir2_open2:
-            it->fsm_state = RDT_STATE_skip;
-            break;
-        case RDT_STATE_readdir3_open2:
-            it->fsm_state = RDT_STATE_do_precaching;
-            break;
-        case RDT_STATE_do_precaching:
-        case RDT_STATE_skip:
-        default:
-            break;
-        }
+    if (slash == NULL) {
+        // Works for AT_FDCWD too.
+        struct stat sb;
+        if (fstatat(atfd, ".", &sb, 0) != 0)
+            return;
 
-        // There could be multiple simultaneously active opendir's for the same
-        // directory, so multiple matches are possible. Currenly, all but first
-        // seen one are ignored.
-        // TODO: handling multiple opendir's for the same directory?
-        break;
+        ikey.dev = sb.st_dev;
+        ikey.ino = sb.st_ino;
+    } else if (fname[0] != '/' && atfd != AT_FDCWD) {
+        char *dir_part = xstrndup(fname, slash - fname);
+        struct stat sb;
+        int res = fstatat(atfd, dir_part, &sb, 0);
+        free(dir_part);
+        if (res != 0)
+            return;
+
+        ikey.dev = sb.st_dev;
+        ikey.ino = sb.st_ino;
+    }
+
+    struct dir_snapshot *snapshot = NULL;
+    char *sample[ORDER_SAMPLE_SIZE];
+    size_t sample_len = 0;
+
+    lock_states_shared();
+    dstate = find_dstate_for_open(fname, &ikey);
+    if (!dstate)
+        goto done;
+
+    const char *name = slash ? slash + 1 : fname;
+
+    lock_dstate(dstate);
+    if (dstate->detached)
+        refresh_detached_state(dstate);
+    if (dstate->implicit_readdir && seek_to_name(dstate, name))
+        return_current_entry(dstate);
+
+    if (track_open(dstate, name)) {
+        snapshot = dir_snapshot_ref(dstate->snapshot);
+        sample_len = dstate->order.sample_len;
+        for (size_t k = 0; k < sample_len; k++)
+            sample[k] = xstrdup(dstate->order.sample[k]);
+    }
+    unlock_dstate(dstate);
+
+done:
+    unlock_states();
+
+    if (snapshot) {
+        struct open_order_target *target = xmalloc(sizeof(*target));
+        target->fname = xstrdup(fname);
+        target->ikey = ikey;
+        order_inference_start(snapshot, sample, sample_len, apply_open_order,
+                              target);
+        dir_snapshot_unref(snapshot);
     }
 }
 
@@ -582,7 +1242,9 @@ do_openat(int (*open_func)(int atfd, const char *fname, int oflag, ...),
 {
     int fd = open_func(atfd, fname, oflag, mode);
     LOG("  open_func in do_openat returns %d", fd);
+    int saved_errno = errno;
     handle_openat(atfd, fname);
+    errno = saved_errno;
     return fd;
 }
 
@@ -607,11 +1269,761 @@ open(const char *fname, int oflag, ...)
     return do_openat(real_openat, AT_FDCWD, fname, oflag, mode);
 }
 
+PRECACHE_EXPORT
+int
+openat64(int atfd, const char *fname, int oflag, ...)
+{
+    int mode = get_mode();
+    LOG("%s: atfd=%d, fname=%s, oflag=%d, mode=%d", __func__, atfd, fname,
+        oflag, mode);
+    ensure_initialized();
+    return do_openat(real_openat64, atfd, fname, oflag, mode);
+}
+
+PRECACHE_EXPORT
+int
+open64(const char *fname, int oflag, ...)
+{
+    int mode = get_mode();
+    LOG("%s: fname=%s, oflag=%d, mode=%d", __func__, fname, oflag, mode);
+    ensure_initialized();
+    return do_openat(real_openat64, AT_FDCWD, fname, oflag, mode);
+}
+
+// Fortified variants are called by programs built with _FORTIFY_SOURCE. They
+// check flags before opening, so calls are forwarded to them as is.
+
+PRECACHE_EXPORT
+int
+__openat_2(int atfd, const char *fname, int oflag)
+{
+    LOG("%s: atfd=%d, fname=%s, oflag=%d", __func__, atfd, fname, oflag);
+    ensure_initialized();
+
+    int fd = real___openat_2(atfd, fname, oflag);
+    int saved_errno = errno;
+    handle_openat(atfd, fname);
+    errno = saved_errno;
+    return fd;
+}
+
+PRECACHE_EXPORT
+int
+__openat64_2(int atfd, const char *fname, int oflag)
+{
+    LOG("%s: atfd=%d, fname=%s, oflag=%d", __func__, atfd, fname, oflag);
+    ensure_initialized();
+
+    int fd = real___openat64_2(atfd, fname, oflag);
+    int saved_errno = errno;
+    handle_openat(atfd, fname);
+    errno = saved_errno;
+    return fd;
+}
+
+PRECACHE_EXPORT
+int
+__open_2(const char *fname, int oflag)
+{
+    LOG("%s: fname=%s, oflag=%d", __func__, fname, oflag);
+    ensure_initialized();
+
+    int fd = real___open_2(fname, oflag);
+    int saved_errno = errno;
+    handle_openat(AT_FDCWD, fname);
+    errno = saved_errno;
+    return fd;
+}
+
+PRECACHE_EXPORT
+int
+__open64_2(const char *fname, int oflag)
+{
+    LOG("%s: fname=%s, oflag=%d", __func__, fname, oflag);
+    ensure_initialized();
+
+    int fd = real___open64_2(fname, oflag);
+    int saved_errno = errno;
+    handle_openat(AT_FDCWD, fname);
+    errno = saved_errno;
+    return fd;
+}
+
+// stdio opens files internally without going through open().
+
+PRECACHE_EXPORT
+FILE *
+fopen(const char *fname, const char *mode)
+{
+    LOG("%s: fname=%s, mode=%s", __func__, fname, mode);
+    ensure_initialized();
+
+    FILE *fp = real_fopen(fname, mode);
+    int saved_errno = errno;
+    handle_openat(AT_FDCWD, fname);
+    errno = saved_errno;
+    return fp;
+}
+
+PRECACHE_EXPORT
+FILE *
+fopen64(const char *fname, const char *mode)
+{
+    LOG("%s: fname=%s, mode=%s", __func__, fname, mode);
+    ensure_initialized();
+
+    FILE *fp = real_fopen64(fname, mode);
+    int saved_errno = errno;
+    handle_openat(AT_FDCWD, fname);
+    errno = saved_errno;
+    return fp;
+}
+
+// Tree walkers, fts(3) and nftw(3), read directories internally. Wrappers
+// below take directory contents from the walker (or read them separately),
+// and treat each returned entry as if it was returned by readdir(). Once bulk
+// reading is detected in one directory, it's assumed for the rest of the walk,
+// and the next sibling directory is precached in advance. The worker thread
+// reads that directory, not the consumer.
+
+// Next sibling directory of the one being walked.
+struct walk_sibling {
+    char *path;  // As seen by the consumer.
+    char *abs_path;
+    dev_t dev;
+    ino_t ino;
+};
+
+struct walk_level {
+    struct dirp_to_state_mapping *dstate;
+    struct dirp_to_state_mapping *lookahead;  // Next sibling directory.
+    struct walk_sibling sibling;
+};
+
+struct walk_tracker {
+    UT_hash_handle hh;
+    void *key;
+    char *cwd;  // Working directory at the start of the walk.
+    bool precaching;
+    UT_array levels;
+
+    // List fts_children() returned for |children_of|, for the fts_read() that
+    // entered it. Consumer calling fts_children() itself gets the same list.
+    FTSENT *children;
+    FTSENT *children_of;
+};
+
+static UT_icd walk_level_icd = {sizeof(struct walk_level), NULL, NULL, NULL};
+
+// Trackers of fts walks, keyed by FTS pointer.
+static struct walk_tracker *walk_trackers = NULL;
+
+static void
+start_precaching(struct dirp_to_state_mapping *dstate)
+{
+    lock_dstate(dstate);
+    if (!dstate->detector.confirmed) {
+        detector_confirm(&dstate->detector);
+        advance_precaching(dstate, dstate->current_idx);
+    }
+    unlock_dstate(dstate);
+}
+
+static char *
+make_walk_path(const char *dir, const char *name)
+{
+    UT_string path;
+    size_t dir_len = strlen(dir);
+    bool dir_ends_with_slash = dir_len > 0 && dir[dir_len - 1] == '/';
+
+    utstring_init(&path);
+    utstring_printf(&path, "%s%s%s", dir, dir_ends_with_slash ? "" : "/",
+                    name);
+    return utstring_steal_data(&path);
+}
+
+static char *
+make_abs_walk_path(struct walk_tracker *t, const char *path)
+{
+    if (path[0] == '/' || t->cwd == NULL)
+        return xstrdup(path);
+    return make_walk_path(t->cwd, path);
+}
+
+static struct walk_tracker *
+walk_tracker_new(void *key)
+{
+    struct walk_tracker *t = xcalloc(1, sizeof(*t));
+
+    t->key = key;
+    t->cwd = getcwd(NULL, 0);
+    t->precaching = false;
+    utarray_init(&t->levels, &walk_level_icd);
+    return t;
+}
+
+static struct walk_level *
+get_walk_level(struct walk_tracker *t, int level)
+{
+    if (level < 0)
+        return NULL;
+
+    while (utarray_len(&t->levels) <= (unsigned)level) {
+        struct walk_level wl = {};
+        utarray_push_back(&t->levels, &wl);
+    }
+
+    return (struct walk_level *)utarray_eltptr(&t->levels, (unsigned)level);
+}
+
+static void
+forget_walk_dstate(struct dirp_to_state_mapping **dstate)
+{
+    if (*dstate) {
+        struct dirp_to_state_mapping *dropped = NULL;
+
+        lock_states_exclusive();
+        forget_dirp_to_state_mapping(*dstate, &dropped);
+        unlock_states();
+        free_dropped_states(&dropped);
+        *dstate = NULL;
+    }
+}
+
+static void
+clear_walk_level(struct walk_level *wl)
+{
+    forget_walk_dstate(&wl->dstate);
+    forget_walk_dstate(&wl->lookahead);
+    free(wl->sibling.path);
+    free(wl->sibling.abs_path);
+    memset(&wl->sibling, 0, sizeof(wl->sibling));
+}
+
+static void
+clear_walk_levels_deeper_than(struct walk_tracker *t, int level)
+{
+    for (unsigned k = level + 1; k < utarray_len(&t->levels); k++)
+        clear_walk_level(get_walk_level(t, k));
+}
+
+static void
+walk_tracker_free(struct walk_tracker *t)
+{
+    clear_walk_levels_deeper_than(t, -1);
+    utarray_done(&t->levels);
+    free(t->cwd);
+    free(t);
+}
+
+// Starts precaching the next sibling directory. It's read as the worker
+// thread maps its entries.
+static void
+walk_prepare_lookahead(struct walk_level *wl)
+{
+    if (wl->lookahead || !wl->sibling.abs_path)
+        return;
+
+    struct dir_snapshot *snapshot = dir_snapshot_new_lazy(wl->sibling.abs_path);
+
+    LOG("%s: looking ahead into %s", __func__, wl->sibling.path);
+    lock_states_exclusive();
+    wl->lookahead = new_dirp_to_state_mapping(
+        wl->sibling.path, snapshot, wl->sibling.dev, wl->sibling.ino);
+    unlock_states();
+    start_precaching(wl->lookahead);
+}
+
+// Consumer enters directory |path| at |level|. Takes ownership of |snapshot|
+// and of paths in |sibling|.
+static void
+walk_enter_dir(struct walk_tracker *t, int level, const char *path,
+               struct dir_snapshot *snapshot, dev_t dir_dev, ino_t dir_ino,
+               const struct walk_sibling *sibling)
+{
+    clear_walk_levels_deeper_than(t, level);
+
+    struct walk_level *wl = get_walk_level(t, level);
+    forget_walk_dstate(&wl->dstate);
+
+    if (wl->lookahead && strcmp(wl->lookahead->dirname, path) == 0) {
+        // Directory contents are already being precached.
+        wl->dstate = wl->lookahead;
+        wl->lookahead = NULL;
+        dir_snapshot_unref(snapshot);
+    } else {
+        forget_walk_dstate(&wl->lookahead);
+        lock_states_exclusive();
+        wl->dstate =
+            new_dirp_to_state_mapping(path, snapshot, dir_dev, dir_ino);
+        unlock_states();
+    }
+
+    free(wl->sibling.path);
+    free(wl->sibling.abs_path);
+    wl->sibling = *sibling;
+
+    if (t->precaching) {
+        start_precaching(wl->dstate);
+        walk_prepare_lookahead(wl);
+    }
+}
+
+static void
+walk_leave_dir(struct walk_tracker *t, int level)
+{
+    clear_walk_levels_deeper_than(t, level);
+
+    // Lookahead for the next sibling is kept.
+    struct walk_level *wl = get_walk_level(t, level);
+    forget_walk_dstate(&wl->dstate);
+}
+
+// Walker returned an entry |name| at |level|.
+static void
+walk_entry(struct walk_tracker *t, int level, const char *name)
+{
+    struct walk_level *parent = get_walk_level(t, level - 1);
+    if (!parent || !parent->dstate)
+        return;
+
+    struct dirp_to_state_mapping *dstate = parent->dstate;
+    lock_dstate(dstate);
+    bool detected =
+        !t->precaching && dstate->detector.confirmed;
+    if (seek_to_name(dstate, name))
+        return_current_entry(dstate);
+    unlock_dstate(dstate);
+
+    if (detected) {
+        LOG("%s: bulk reading detected in %s", __func__, dstate->dirname);
+        t->precaching = true;
+        walk_prepare_lookahead(parent);
+    }
+}
+
+// Tracker is only used by the thread walking |ftsp|, so it doesn't need a lock
+// once found.
+static struct walk_tracker *
+find_fts_walk_tracker(FTS *ftsp)
+{
+    struct walk_tracker *t = NULL;
+
+    lock_states_shared();
+    HASH_FIND_PTR(walk_trackers, &ftsp, t);
+    unlock_states();
+    return t;
+}
+
+static void
+handle_fts_open(FTS *ftsp)
+{
+    if (!ftsp || !tracking_enabled())
+        return;
+
+    struct walk_tracker *t = walk_tracker_new(ftsp);
+
+    lock_states_exclusive();
+    HASH_ADD_PTR(walk_trackers, key, t);
+    unlock_states();
+}
+
+static void
+handle_fts_enter_dir(FTS *ftsp, FTSENT *ent)
+{
+    // Path buffer is shared between entries, and gets modified by
+    // fts_children().
+    char *path = xstrdup(ent->fts_path);
+    char *parent_path =
+        xstrndup(ent->fts_path, ent->fts_pathlen - ent->fts_namelen);
+
+    // Directory contents, in the order they will be returned by fts_read().
+    // fts_read() will reuse this list, and so will fts_children().
+    FTSENT *children = real_fts_children(ftsp, 0);
+
+    struct walk_tracker *t = find_fts_walk_tracker(ftsp);
+    if (!t)
+        goto done;
+
+    t->children = children;
+    t->children_of = ent;
+
+    char *abs_path = make_abs_walk_path(t, path);
+    struct dir_snapshot *snapshot = dir_snapshot_new_empty(abs_path);
+    free(abs_path);
+
+    for (FTSENT *it = children; it != NULL; it = it->fts_link) {
+        bool has_stat = it->fts_info != FTS_NS && it->fts_info != FTS_NSOK &&
+                        it->fts_statp != NULL;
+        dir_snapshot_append(snapshot, has_stat ? it->fts_statp->st_ino : 0,
+                            has_stat ? IFTODT(it->fts_statp->st_mode)
+                                     : DT_UNKNOWN,
+                            it->fts_name);
+    }
+
+    // Siblings are linked too, and are already stat()ed.
+    struct walk_sibling sibling = {};
+    for (FTSENT *it = ent->fts_link; it != NULL; it = it->fts_link) {
+        if (it->fts_info == FTS_D) {
+            sibling.path = make_walk_path(parent_path, it->fts_name);
+            sibling.abs_path = make_abs_walk_path(t, sibling.path);
+            sibling.dev = it->fts_statp->st_dev;
+            sibling.ino = it->fts_statp->st_ino;
+            break;
+        }
+    }
+
+    walk_enter_dir(t, ent->fts_level, path, snapshot, ent->fts_statp->st_dev,
+                   ent->fts_statp->st_ino, &sibling);
+
+done:
+    free(path);
+    free(parent_path);
+}
+
+static void
+handle_fts_read(FTS *ftsp, FTSENT *ent)
+{
+    if (!ent)
+        return;
+
+    int saved_errno = errno;
+
+    struct walk_tracker *t = find_fts_walk_tracker(ftsp);
+    if (!t)
+        goto done;
+
+    switch (ent->fts_info) {
+    case FTS_D:
+        walk_entry(t, ent->fts_level, ent->fts_name);
+        handle_fts_enter_dir(ftsp, ent);
+        break;
+    case FTS_DP:
+        walk_leave_dir(t, ent->fts_level);
+        break;
+    default:
+        walk_entry(t, ent->fts_level, ent->fts_name);
+        break;
+    }
+
+done:
+    errno = saved_errno;
+}
+
+// Returns the list built for the directory fts_read() has just returned, if
+// |options| would make the same list. glibc would read the directory again.
+static FTSENT *
+reuse_fts_children(FTS *ftsp, int options)
+{
+    struct walk_tracker *t = find_fts_walk_tracker(ftsp);
+    if (!t)
+        return NULL;
+
+    FTSENT *children = t->children;
+    bool same = options == 0 && children != NULL &&
+                t->children_of == ftsp->fts_cur &&
+                ftsp->fts_child == children;
+
+    // List is rebuilt otherwise, and may get the same address.
+    t->children = NULL;
+    t->children_of = NULL;
+    if (!same)
+        return NULL;
+
+    t->children = children;
+    t->children_of = ftsp->fts_cur;
+    return children;
+}
+
+static void
+handle_fts_close(FTS *ftsp)
+{
+    lock_states_exclusive();
+    struct walk_tracker *t = NULL;
+    HASH_FIND_PTR(walk_trackers, &ftsp, t);
+    if (t)
+        HASH_DEL(walk_trackers, t);
+    unlock_states();
+
+    if (t)
+        walk_tracker_free(t);
+}
+
+PRECACHE_EXPORT
+FTS *
+fts_open(char *const *path_argv, int options,
+         int (*compar)(const FTSENT **, const FTSENT **))
+{
+    ensure_initialized();
+    LOG("%s: options=%d", __func__, options);
+
+    FTS *ftsp = real_fts_open(path_argv, options, compar);
+    handle_fts_open(ftsp);
+    return ftsp;
+}
+
+PRECACHE_EXPORT
+FTSENT *
+fts_read(FTS *ftsp)
+{
+    ensure_initialized();
+
+    FTSENT *ent = real_fts_read(ftsp);
+    handle_fts_read(ftsp, ent);
+    return ent;
+}
+
+PRECACHE_EXPORT
+FTSENT *
+fts_children(FTS *ftsp, int options)
+{
+    ensure_initialized();
+    LOG("%s: ftsp=%p, options=%d", __func__, ftsp, options);
+
+    FTSENT *children = reuse_fts_children(ftsp, options);
+    if (children) {
+        errno = 0;
+        return children;
+    }
+
+    return real_fts_children(ftsp, options);
+}
+
+PRECACHE_EXPORT
+int
+fts_close(FTS *ftsp)
+{
+    ensure_initialized();
+    LOG("%s: ftsp=%p", __func__, ftsp);
+
+    handle_fts_close(ftsp);
+    return real_fts_close(ftsp);
+}
+
+#if __GLIBC_PREREQ(2, 34)
+// Large file variants. Just like with readdir64(), this redirection depends on
+// structures being the same.
+_Static_assert(sizeof(FTSENT) == sizeof(FTSENT64) &&
+                   sizeof(struct stat) == sizeof(struct stat64),
+               "FTSENT64 is expected to precisely match FTSENT");
+
+PRECACHE_EXPORT
+FTS64 *
+fts64_open(char *const *path_argv, int options,
+           int (*compar)(const FTSENT64 **, const FTSENT64 **))
+{
+    ensure_initialized();
+    LOG("%s: options=%d", __func__, options);
+
+    FTS *ftsp = real_fts64_open(path_argv, options, (void *)compar);
+    handle_fts_open(ftsp);
+    return (FTS64 *)ftsp;
+}
+
+PRECACHE_EXPORT
+FTSENT64 *
+fts64_read(FTS64 *ftsp)
+{
+    ensure_initialized();
+
+    FTSENT *ent = real_fts64_read((FTS *)ftsp);
+    handle_fts_read((FTS *)ftsp, ent);
+    return (FTSENT64 *)ent;
+}
+
+PRECACHE_EXPORT
+FTSENT64 *
+fts64_children(FTS64 *ftsp, int options)
+{
+    ensure_initialized();
+    LOG("%s: ftsp=%p, options=%d", __func__, ftsp, options);
+
+    FTSENT *children = reuse_fts_children((FTS *)ftsp, options);
+    if (children) {
+        errno = 0;
+        return (FTSENT64 *)children;
+    }
+
+    return (FTSENT64 *)real_fts64_children((FTS *)ftsp, options);
+}
+
+PRECACHE_EXPORT
+int
+fts64_close(FTS64 *ftsp)
+{
+    ensure_initialized();
+    LOG("%s: ftsp=%p", __func__, ftsp);
+
+    handle_fts_close((FTS *)ftsp);
+    return real_fts64_close((FTS *)ftsp);
+}
+#endif
+
+typedef int (*nftw_callback_t)(const char *fpath, const struct stat *sb,
+                               int typeflag, struct FTW *ftwbuf);
+
+struct nftw_context {
+    nftw_callback_t fn;
+    struct walk_tracker *tracker;
+    struct nftw_context *outer;
+};
+
+// nftw() passes no user data to the callback. Nested walks are possible.
+static __thread struct nftw_context *nftw_context = NULL;
+
+// Returns the path of the next subdirectory after |name|, and its inode in
+// |*ino|, or NULL.
+static char *
+find_next_sibling_dir(struct dirp_to_state_mapping *dstate, const char *name,
+                      ino_t *ino)
+{
+    struct dir_snapshot *snapshot = dstate->snapshot;
+    const struct dirent *de;
+    size_t k = 0;
+
+    while ((de = dir_snapshot_entry(snapshot, k)) != NULL &&
+           strcmp(de->d_name, name) != 0)
+        k++;
+
+    if (!de)
+        return NULL;
+
+    for (k++; (de = dir_snapshot_entry(snapshot, k)) != NULL; k++) {
+        if (de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 &&
+            strcmp(de->d_name, "..") != 0)  //
+        {
+            *ino = de->d_ino;
+            return make_walk_path(dstate->dirname, de->d_name);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+handle_nftw_entry(struct walk_tracker *t, const char *fpath, int typeflag,
+                  struct FTW *ftwbuf)
+{
+    if (ftwbuf->level == 0)
+        goto done;
+
+    // Directory is entered lazily, at its first entry. That works the same
+    // way with or without FTW_DEPTH.
+    int parent_len = ftwbuf->base;
+    while (parent_len > 1 && fpath[parent_len - 1] == '/')
+        parent_len -= 1;
+
+    struct walk_level *parent = get_walk_level(t, ftwbuf->level - 1);
+    if (!parent->dstate ||
+        strncmp(parent->dstate->dirname, fpath, parent_len) != 0 ||
+        parent->dstate->dirname[parent_len] != '\0')  //
+    {
+        char *parent_path = xstrndup(fpath, parent_len);
+        char *abs_path = make_abs_walk_path(t, parent_path);
+
+        // Entries are read as the consumer gets to them, or by the worker
+        // once precaching. Directory that was looked ahead into already has
+        // them, and this snapshot is never read.
+        struct stat sb;
+        if (stat(abs_path, &sb) == 0) {
+            struct dir_snapshot *snapshot = dir_snapshot_new_lazy(abs_path);
+            struct walk_level *grandparent =
+                get_walk_level(t, ftwbuf->level - 2);
+            struct walk_sibling sibling = {};
+
+            if (grandparent && grandparent->dstate) {
+                const char *slash = strrchr(parent_path, '/');
+                sibling.path = find_next_sibling_dir(
+                    grandparent->dstate, slash ? slash + 1 : parent_path,
+                    &sibling.ino);
+                sibling.dev = grandparent->dstate->dir_dev;
+            }
+            if (sibling.path)
+                sibling.abs_path = make_abs_walk_path(t, sibling.path);
+
+            walk_enter_dir(t, ftwbuf->level - 1, parent_path, snapshot,
+                           sb.st_dev, sb.st_ino, &sibling);
+        }
+
+        free(abs_path);
+        free(parent_path);
+    }
+
+    walk_entry(t, ftwbuf->level, fpath + ftwbuf->base);
+
+done:
+    if (typeflag == FTW_DP)
+        walk_leave_dir(t, ftwbuf->level);
+}
+
+static int
+nftw_callback(const char *fpath, const struct stat *sb, int typeflag,
+              struct FTW *ftwbuf)
+{
+    struct nftw_context *ctx = nftw_context;
+    int saved_errno = errno;
+
+    handle_nftw_entry(ctx->tracker, fpath, typeflag, ftwbuf);
+
+    errno = saved_errno;
+    return ctx->fn(fpath, sb, typeflag, ftwbuf);
+}
+
+static int
+do_nftw(int (*nftw_func)(const char *, nftw_callback_t, int, int),
+        const char *dirpath, nftw_callback_t fn, int nopenfd, int flags)
+{
+    if (!tracking_enabled())
+        return nftw_func(dirpath, fn, nopenfd, flags);
+
+    struct nftw_context ctx = {
+        .fn = fn,
+        .tracker = walk_tracker_new(NULL),
+        .outer = nftw_context,
+    };
+
+    nftw_context = &ctx;
+    int res = nftw_func(dirpath, nftw_callback, nopenfd, flags);
+    nftw_context = ctx.outer;
+
+    int saved_errno = errno;
+    walk_tracker_free(ctx.tracker);
+    errno = saved_errno;
+
+    return res;
+}
+
+PRECACHE_EXPORT
+int
+nftw(const char *dirpath, nftw_callback_t fn, int nopenfd, int flags)
+{
+    ensure_initialized();
+    LOG("%s: dirpath=%s, flags=%d", __func__, dirpath, flags);
+    return do_nftw(real_nftw, dirpath, fn, nopenfd, flags);
+}
+
+PRECACHE_EXPORT
+int
+nftw64(const char *dirpath,
+       int (*fn)(const char *fpath, const struct stat64 *sb, int typeflag,
+                 struct FTW *ftwbuf),
+       int nopenfd, int flags)
+{
+    ensure_initialized();
+    LOG("%s: dirpath=%s, flags=%d", __func__, dirpath, flags);
+
+    // struct stat64 matches struct stat here, see above.
+    return do_nftw(real_nftw64, dirpath, (nftw_callback_t)fn, nopenfd, flags);
+}
+
 __attribute__((destructor)) static void
 destructor(void)
 {
-    lock();
+    struct dirp_to_state_mapping *dropped = NULL;
+
+    lock_states_exclusive();
     encfs_mapper_cleanup();
-    clear_dirp_to_state_map();
-    unlock();
+    clear_dirp_to_state_map(&dropped);
+    unlock_states();
+    free_dropped_states(&dropped);
 }
@@ -19,6 +19,15 @@ xstrdup(const char *src)
     return dst;
 }
 
+static inline char *
+xstrndup(const char *src, size_t n)
+{
+    char *dst = strndup(src, n);
+    if (!dst)
+        precache_oom();
+    return dst;
+}
+
 static inline void *
 xmalloc(size_t sz)
 {
@@ -37,6 +46,15 @@ xcalloc(size_t n, size_t sz)
     return ptr;
 }
 
+static inline void *
+xrealloc(void *ptr, size_t sz)
+{
+    void *new_ptr = realloc(ptr, sz);
+    if (!new_ptr)
+        precache_oom();
+    return new_ptr;
+}
+
 static inline void *
 memappend(void *p, const void *str, size_t len)
 {
@@ -0,0 +1,296 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#include "order.h"
+#include "intercepted_functions.h"
+#include "mem.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Opens that don't follow the inferred order, in a row, before it's dropped.
+#define ORDER_MISSES_ALLOWED 2
+
+// Failed inference attempts before giving up on the directory. Each attempt
+// may stat every entry.
+#define ORDER_ATTEMPTS_ALLOWED 3
+
+enum entry_order {
+    ORDER_READDIR,
+    ORDER_NAME,
+    ORDER_NAME_REVERSE,
+    ORDER_SIZE,
+    ORDER_SIZE_REVERSE,
+    ORDER_COUNT,
+};
+
+struct candidate {
+    struct dirent *ent;
+    off_t size;  // -1 if unknown.
+};
+
+void
+order_tracker_init(struct order_tracker *ot)
+{
+    memset(ot, 0, sizeof(*ot));
+}
+
+static void
+free_sample(struct order_tracker *ot)
+{
+    for (size_t k = 0; k < ot->sample_len; k++)
+        free(ot->sample[k]);
+    ot->sample_len = 0;
+    ot->inferring = false;
+}
+
+void
+order_tracker_reset(struct order_tracker *ot)
+{
+    free_sample(ot);
+    dir_snapshot_unref(ot->ordered);
+    order_tracker_init(ot);
+}
+
+bool
+order_tracker_add_sample(struct order_tracker *ot, const char *name)
+{
+    if (ot->inferring || ot->ordered || ot->attempts >= ORDER_ATTEMPTS_ALLOWED)
+        return false;
+
+    ot->sample[ot->sample_len] = xstrdup(name);
+    ot->sample_len += 1;
+    if (ot->sample_len < ORDER_SAMPLE_SIZE)
+        return false;
+
+    ot->inferring = true;
+    ot->attempts += 1;
+    return true;
+}
+
+void
+order_tracker_set(struct order_tracker *ot, struct dir_snapshot *ordered,
+                  size_t last_idx)
+{
+    free_sample(ot);
+    if (!ordered)
+        return;
+
+    dir_snapshot_unref(ot->ordered);
+    ot->ordered = ordered;
+    ot->cursor_idx = last_idx;
+    ot->misses = 0;
+}
+
+bool
+order_tracker_open(struct order_tracker *ot, const char *name, size_t *idx)
+{
+    struct dir_snapshot *ordered = ot->ordered;
+    struct dirent *de;
+
+    // Most likely it's the next one.
+    size_t k = ot->cursor_idx + 1;
+    de = dir_snapshot_entry(ordered, k);
+    if (de && strcmp(de->d_name, name) == 0)
+        goto found;
+
+    for (k = 0; (de = dir_snapshot_entry(ordered, k)) != NULL; k++) {
+        if (strcmp(de->d_name, name) == 0)
+            goto found;
+    }
+
+    ot->misses += 1;
+    if (ot->misses > ORDER_MISSES_ALLOWED) {
+        dir_snapshot_unref(ot->ordered);
+        ot->ordered = NULL;
+    }
+    return false;
+
+found:
+    ot->cursor_idx = k;
+    ot->misses = 0;
+    *idx = k;
+    return true;
+}
+
+static const char *
+get_extension(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+
+    // Leading dot marks hidden files, that's not an extension.
+    return dot && dot != name ? dot : "";
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+    const struct candidate *ca = a;
+    const struct candidate *cb = b;
+
+    return strcmp(ca->ent->d_name, cb->ent->d_name);
+}
+
+static int
+compare_names_reverse(const void *a, const void *b)
+{
+    return compare_names(b, a);
+}
+
+static int
+compare_sizes(const void *a, const void *b)
+{
+    const struct candidate *ca = a;
+    const struct candidate *cb = b;
+
+    if (ca->size != cb->size)
+        return ca->size < cb->size ? -1 : 1;
+    return compare_names(a, b);
+}
+
+static int
+compare_sizes_reverse(const void *a, const void *b)
+{
+    const struct candidate *ca = a;
+    const struct candidate *cb = b;
+
+    if (ca->size != cb->size)
+        return ca->size > cb->size ? -1 : 1;
+    return compare_names(a, b);
+}
+
+static bool
+load_sizes(const char *dirname, struct candidate *all, size_t n)
+{
+    int dir_fd = real_open(dirname, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+        return false;
+
+    for (size_t k = 0; k < n; k++) {
+        struct stat sb;
+        if (fstatat(dir_fd, all[k].ent->d_name, &sb, 0) == 0 &&
+            S_ISREG(sb.st_mode))  //
+        {
+            all[k].size = sb.st_size;
+        }
+    }
+
+    real_close(dir_fd);
+    return true;
+}
+
+// Returns true if |names| are next to each other in |entries|, in that order.
+static bool
+names_are_adjacent(const struct candidate *entries, size_t n,
+                   char *const *names, size_t n_names, size_t *last_idx)
+{
+    for (size_t k = 0; k + n_names <= n; k++) {
+        if (strcmp(entries[k].ent->d_name, names[0]) != 0)
+            continue;
+
+        // Names are unique, so there is no other place to look at.
+        for (size_t j = 1; j < n_names; j++) {
+            if (strcmp(entries[k + j].ent->d_name, names[j]) != 0)
+                return false;
+        }
+
+        *last_idx = k + n_names - 1;
+        return true;
+    }
+
+    return false;
+}
+
+struct dir_snapshot *
+order_infer(struct dir_snapshot *snapshot, char *const *names, size_t n_names,
+            size_t *last_idx)
+{
+    struct dir_snapshot *result = NULL;
+    struct candidate *all = NULL;
+    struct candidate *entries = NULL;
+    size_t n_all = 0;
+
+    if (n_names == 0)
+        return NULL;
+
+    size_t count = dir_snapshot_read_all(snapshot);
+    all = xmalloc((count + 1) * sizeof(*all));
+    entries = xmalloc((count + 1) * sizeof(*entries));
+
+    // Only regular files are opened.
+    for (size_t k = 0; k < count; k++) {
+        struct dirent *de = dir_snapshot_entry(snapshot, k);
+        if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
+            all[n_all].ent = de;
+            all[n_all].size = -1;
+            n_all += 1;
+        }
+    }
+
+    // Consumer may select files by extension.
+    const char *ext = get_extension(names[0]);
+    bool same_extension = true;
+    for (size_t k = 1; k < n_names; k++) {
+        if (strcmp(get_extension(names[k]), ext) != 0)
+            same_extension = false;
+    }
+
+    bool sizes_tried = false;
+    bool sizes_loaded = false;
+
+    for (int filtered = 0; filtered <= (same_extension ? 1 : 0); filtered++) {
+        for (int order = 0; order < ORDER_COUNT; order++) {
+            bool by_size = order == ORDER_SIZE || order == ORDER_SIZE_REVERSE;
+            if (by_size && !sizes_tried) {
+                sizes_tried = true;
+                sizes_loaded = load_sizes(snapshot->dirname, all, n_all);
+            }
+            if (by_size && !sizes_loaded)
+                continue;
+
+            size_t n = 0;
+            for (size_t k = 0; k < n_all; k++) {
+                if (filtered &&
+                    strcmp(get_extension(all[k].ent->d_name), ext) != 0)
+                    continue;
+                entries[n++] = all[k];
+            }
+
+            switch (order) {
+            case ORDER_NAME:
+                qsort(entries, n, sizeof(*entries), compare_names);
+                break;
+            case ORDER_NAME_REVERSE:
+                qsort(entries, n, sizeof(*entries), compare_names_reverse);
+                break;
+            case ORDER_SIZE:
+                qsort(entries, n, sizeof(*entries), compare_sizes);
+                break;
+            case ORDER_SIZE_REVERSE:
+                qsort(entries, n, sizeof(*entries), compare_sizes_reverse);
+                break;
+            case ORDER_READDIR:
+            default:
+                break;
+            }
+
+            if (!names_are_adjacent(entries, n, names, n_names, last_idx))
+                continue;
+
+            result = dir_snapshot_new_empty(snapshot->dirname);
+            for (size_t k = 0; k < n; k++) {
+                dir_snapshot_append(result, entries[k].ent->d_ino,
+                                    entries[k].ent->d_type,
+                                    entries[k].ent->d_name);
+            }
+            goto done;
+        }
+    }
+
+done:
+    free(all);
+    free(entries);
+    return result;
+}
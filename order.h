@@ -0,0 +1,59 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "dir_snapshot.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ORDER_SAMPLE_SIZE 4
+
+// Tracks the order in which consumer opens files, when that's not the readdir
+// order. For example, a consumer may read the whole directory first, sort the
+// names, and only then open files. A few opened names are collected as a
+// sample, which order_infer() then matches against known orderings.
+struct order_tracker {
+    char *sample[ORDER_SAMPLE_SIZE];
+    size_t sample_len;
+    bool inferring;     // Sample was handed out to order_infer().
+    unsigned attempts;  // Samples handed out so far.
+
+    // Entries in the inferred order, or NULL if the order is not known.
+    struct dir_snapshot *ordered;
+    size_t cursor_idx;  // Entry opened last.
+    unsigned misses;
+};
+
+void
+order_tracker_init(struct order_tracker *ot);
+
+// Forgets the sample and the inferred order.
+void
+order_tracker_reset(struct order_tracker *ot);
+
+// Adds |name| to the sample. Returns true when the sample is complete, and
+// should be passed to order_infer().
+bool
+order_tracker_add_sample(struct order_tracker *ot, const char *name);
+
+// Takes ownership of |ordered| which came from order_infer().
+void
+order_tracker_set(struct order_tracker *ot, struct dir_snapshot *ordered,
+                  size_t last_idx);
+
+// Consumer opened |name| while the order is known. Returns true and the index
+// of the entry in the ordered list if it's there. After several opens that
+// don't follow the order, it's forgotten.
+bool
+order_tracker_open(struct order_tracker *ot, const char *name, size_t *idx);
+
+// Finds an ordering of regular files in |snapshot| in which |names| come one
+// right after another. Tried are: readdir order, names sorted in either
+// direction, and sizes sorted in either direction. Each is also tried limited
+// to files with the same extension as all of |names|. Returns a new snapshot
+// with entries in that order, and the index of the last of |names| in it, or
+// NULL if no ordering fits. May call stat() on every entry.
+struct dir_snapshot *
+order_infer(struct dir_snapshot *snapshot, char *const *names, size_t n_names,
+            size_t *last_idx);
@@ -0,0 +1,225 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#include "plan_file.h"
+#include "intercepted_functions.h"
+#include "mem.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utstring.h>
+
+#define PLAN_MAGIC "PCPLAN1"
+
+struct plan_file_header {
+    char magic[8];
+    uint64_t file_count;
+    uint64_t segment_count;
+    uint64_t names_len;
+};
+
+static bool
+write_files(struct segment_plan *plan, FILE *fp, uint64_t *names_len)
+{
+    *names_len = 0;
+
+    for (size_t k = 0; k < plan->file_count; k++) {
+        const char *path = plan->files[k]->path;
+        struct plan_file_entry entry = {.name_offset = *names_len};
+        struct stat sb;
+
+        // Files were opened just now, so this doesn't touch the disk.
+        if (stat(path, &sb) == 0) {
+            entry.dev = sb.st_dev;
+            entry.ino = sb.st_ino;
+            entry.size = sb.st_size;
+            entry.mtime_sec = sb.st_mtim.tv_sec;
+            entry.mtime_nsec = sb.st_mtim.tv_nsec;
+        }
+
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+            return false;
+        *names_len += strlen(path) + 1;
+    }
+
+    return true;
+}
+
+static bool
+write_segments(struct segment_plan *plan, FILE *fp)
+{
+    struct segment_plan_reader *reader = segment_plan_reader_new(plan);
+    struct plan_segment seg;
+    bool ok = true;
+
+    while (ok && segment_plan_reader_next(reader, &seg)) {
+        // Padding is zeroed, so output doesn't depend on stack contents.
+        struct plan_segment out;
+        memset(&out, 0, sizeof(out));
+        out.physical_pos = seg.physical_pos;
+        out.file_offset = seg.file_offset;
+        out.extent_length = seg.extent_length;
+        out.file_idx = seg.file_idx;
+        ok = fwrite(&out, sizeof(out), 1, fp) == 1;
+    }
+
+    segment_plan_reader_free(reader);
+    return ok;
+}
+
+static bool
+write_plan(struct segment_plan *plan, FILE *fp)
+{
+    struct plan_file_header header = {.magic = PLAN_MAGIC};
+    bool ok;
+
+    header.file_count = plan->file_count;
+    header.segment_count = segment_plan_size(plan);
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         write_files(plan, fp, &header.names_len) && write_segments(plan, fp);
+
+    for (size_t k = 0; ok && k < plan->file_count; k++) {
+        const char *name = plan->files[k]->path;
+        ok = fwrite(name, strlen(name) + 1, 1, fp) == 1;
+    }
+
+    // Name table size is only known now.
+    return ok && fseek(fp, 0, SEEK_SET) == 0 &&
+           fwrite(&header, sizeof(header), 1, fp) == 1;
+}
+
+// Writes a new file next to |path|, and renames it over, so an interrupted
+// run doesn't leave a truncated plan, and readers see either plan in full.
+int
+plan_file_write(struct segment_plan *plan, const char *path)
+{
+    UT_string tmp_path;
+
+    utstring_init(&tmp_path);
+    utstring_printf(&tmp_path, "%s.XXXXXX", path);
+
+    int fd = mkstemp(utstring_body(&tmp_path));
+    if (fd < 0)
+        goto err_1;
+
+    // mkstemp() makes the file private. Plans get the permissions fopen()
+    // would give them, as before.
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        real_close(fd);
+        goto err_2;
+    }
+
+    bool written = write_plan(plan, fp) && fflush(fp) == 0 && fsync(fd) == 0;
+    if (fclose(fp) != 0 || !written)
+        goto err_2;
+
+    if (rename(utstring_body(&tmp_path), path) != 0)
+        goto err_2;
+
+    utstring_done(&tmp_path);
+    return 0;
+
+err_2:
+    unlink(utstring_body(&tmp_path));
+err_1:
+    utstring_done(&tmp_path);
+    return -1;
+}
+
+struct plan_file *
+plan_file_open(const char *path)
+{
+    int fd = real_open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct plan_file *pf = NULL;
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 ||
+        (size_t)sb.st_size < sizeof(struct plan_file_header))  //
+    {
+        goto done;
+    }
+
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        goto done;
+
+    const struct plan_file_header *header = map;
+    uint64_t size = sb.st_size;
+    if (memcmp(header->magic, PLAN_MAGIC, sizeof(header->magic)) != 0 ||
+        header->file_count > size || header->segment_count > size ||
+        header->names_len > size ||
+        sizeof(*header) + header->file_count * sizeof(pf->files[0]) +
+                header->segment_count * sizeof(pf->segments[0]) +
+                header->names_len !=
+            size)  //
+    {
+        munmap(map, sb.st_size);
+        goto done;
+    }
+
+    pf = xcalloc(1, sizeof(*pf));
+    pf->map = map;
+    pf->map_len = sb.st_size;
+    pf->files = (const void *)(header + 1);
+    pf->file_count = header->file_count;
+    pf->segments = (const void *)(pf->files + pf->file_count);
+    pf->segment_count = header->segment_count;
+    pf->names = (const void *)(pf->segments + pf->segment_count);
+    pf->names_len = header->names_len;
+
+done:
+    real_close(fd);
+    return pf;
+}
+
+void
+plan_file_close(struct plan_file *pf)
+{
+    if (!pf)
+        return;
+
+    munmap(pf->map, pf->map_len);
+    free(pf);
+}
+
+const char *
+plan_file_name(const struct plan_file *pf, size_t idx)
+{
+    if (idx >= pf->file_count)
+        return NULL;
+
+    uint64_t offset = pf->files[idx].name_offset;
+    if (offset >= pf->names_len)
+        return NULL;
+
+    // Name must end within the table.
+    if (!memchr(pf->names + offset, '\0', pf->names_len - offset))
+        return NULL;
+
+    return pf->names + offset;
+}
+
+bool
+plan_file_revalidate(const struct plan_file *pf, size_t idx)
+{
+    const struct plan_file_entry *entry = &pf->files[idx];
+    const char *name = plan_file_name(pf, idx);
+    struct stat sb;
+
+    return name && stat(name, &sb) == 0 && entry->dev == sb.st_dev &&
+           entry->ino == sb.st_ino && entry->size == (uint64_t)sb.st_size &&
+           entry->mtime_sec == sb.st_mtim.tv_sec &&
+           entry->mtime_nsec == (uint32_t)sb.st_mtim.tv_nsec;
+}
@@ -0,0 +1,54 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "segments.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Saved segment plan, so it can be executed later without mapping anything.
+// Layout: header, file table, segments sorted by physical_pos, then file
+// names. The file is mmap()ed as is.
+struct plan_file_entry {
+    uint64_t name_offset;  // In the name table.
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t reserved;
+};
+
+struct plan_file {
+    void *map;
+    size_t map_len;
+    const struct plan_file_entry *files;
+    size_t file_count;
+    const struct plan_segment *segments;
+    size_t segment_count;
+    const char *names;
+    size_t names_len;
+};
+
+// Writes all segments of |plan| to |path|, in physical_pos order. Returns 0 on
+// success, or -1.
+int
+plan_file_write(struct segment_plan *plan, const char *path);
+
+// Returns NULL if |path| can't be read, or is not a plan file.
+struct plan_file *
+plan_file_open(const char *path);
+
+void
+plan_file_close(struct plan_file *pf);
+
+// Returns name of file |idx|, or NULL if the plan file is damaged.
+const char *
+plan_file_name(const struct plan_file *pf, size_t idx);
+
+// Checks that file |idx| is still the same file, of the same size and mtime,
+// so its saved extents are still right.
+bool
+plan_file_revalidate(const struct plan_file *pf, size_t idx);
@@ -1,110 +1,853 @@
 // Copyright 2021  Rinat Ibragimov
 // SPDX-License-Identifier: MIT
 
+#define _GNU_SOURCE
 #include "encfs_mapper.h"
 #include "intercepted_functions.h"
+#include "io_queue.h"
+#include "mem.h"
+#include "plan_file.h"
 #include "progress.h"
+#include "read_engine.h"
 #include "segments.h"
+#include <dirent.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <utlist.h>
+#include <uthash.h>
+
+#define DEFAULT_JOBS 4
+#define DEFAULT_WINDOW 4096
+#define MAX_JOBS 1024
+#define MAX_WINDOW (1024 * 1024)
+
+// File to be mapped.
+struct candidate {
+    char *path;
+    size_t dir_len;  // Length of the parent directory part of |path|.
+    size_t order;    // Position in parent directory order.
+    ino_t ino;       // Zero if not known.
+};
+
+struct name_entry {
+    UT_hash_handle hh;
+    struct candidate *candidate;
+};
+
+// State shared by mapping threads.
+struct mapper {
+    struct candidate *candidates;
+    size_t candidate_count;
+    size_t *groups;  // First candidate of each parent directory, and the end.
+    size_t group_count;
+    size_t next;     // Next group or candidate to take. Accessed atomically.
+    struct fd_pool *pool;
+    struct extent_cache *cache;
+
+    pthread_mutex_t lock;  // Guards everything below.
+    struct segment_plan *plan;
+    size_t mapped_count;
+    size_t segment_count;
+};
+
+// Segment waiting in the streaming window. Holds a reference to |file|.
+struct window_segment {
+    uint64_t physical_pos;
+    uint64_t file_offset;
+    uint64_t extent_length;
+    struct pooled_file *file;
+};
+
+// Segments are taken in ascending order, starting from |head|. Segments that
+// come behind the head wait for the next sweep, so the disk doesn't seek back
+// and forth. Both are min-heaps.
+struct elevator {
+    struct window_segment *ahead;
+    size_t ahead_len;
+    struct window_segment *behind;
+    size_t behind_len;
+    uint64_t head;
+};
+
+// Input of the streaming mode.
+struct name_source {
+    pthread_mutex_t lock;
+    char **names;
+    size_t name_count;
+    size_t next_name;
+    bool read_stdin;
+    int delim;
+    char *line;
+    size_t line_size;
+};
+
+// State shared by mapping threads and the reading thread in the streaming
+// mode.
+struct streamer {
+    struct name_source *input;
+    struct fd_pool *pool;
+    struct extent_cache *cache;
+
+    pthread_mutex_t lock;  // Guards everything below.
+    pthread_cond_t window_full;
+    pthread_cond_t window_has_room;
+    struct elevator window;
+    size_t window_len;
+    size_t window_size;
+    unsigned mappers_running;
+};
 
 static void
-read_segment(struct segment *it, size_t *bytes_in_segment)
+unpin_file(void *file)
 {
-    int fd = open(it->file_name, O_RDONLY);
+    fd_pool_unpin(file);
+}
+
+static void
+read_segment(struct io_queue *queue, struct pooled_file *file,
+             const struct plan_segment *seg)
+{
+    int fd = fd_pool_pin(file);
     if (fd < 0)
         return;
 
-    if (bytes_in_segment)
-        *bytes_in_segment = 0;
-
-    static char buf[512 * 1024];
-    ssize_t to_read = it->extent_length;
-    off_t ofs = it->file_offset;
-    while (to_read > 0) {
-        ssize_t chunk_sz =
-            to_read < (ssize_t)sizeof(buf) ? to_read : (ssize_t)sizeof(buf);
-        ssize_t bytes_read = pread(fd, buf, chunk_sz, ofs);
-        if (bytes_read == -1 && errno == EINTR) {
-            // Try again.
-            continue;
+    io_queue_submit(queue, fd, seg->file_offset, seg->extent_length,
+                    unpin_file, file);
+}
+
+static void
+add_candidate(struct candidate **candidates, size_t *count, size_t *capacity,
+              const char *path)
+{
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        *candidates = xrealloc(*candidates, *capacity * sizeof(**candidates));
+    }
+
+    struct candidate *c = &(*candidates)[(*count)++];
+    const char *slash = strrchr(path, '/');
+
+    c->path = xstrdup(path);
+    // Files in "/" keep the slash, so they don't end up with files in ".".
+    c->dir_len = slash ? (slash == path ? 1 : (size_t)(slash - path)) : 0;
+    c->order = 0;
+    c->ino = 0;
+}
+
+static bool
+same_dir(const struct candidate *a, const struct candidate *b)
+{
+    return a->dir_len == b->dir_len &&
+           memcmp(a->path, b->path, a->dir_len) == 0;
+}
+
+static int
+dir_comparator(const void *a, const void *b)
+{
+    const struct candidate *a_ = a;
+    const struct candidate *b_ = b;
+    size_t len = a_->dir_len < b_->dir_len ? a_->dir_len : b_->dir_len;
+
+    int res = memcmp(a_->path, b_->path, len);
+    if (res != 0)
+        return res;
+    if (a_->dir_len != b_->dir_len)
+        return a_->dir_len < b_->dir_len ? -1 : 1;
+    return strcmp(a_->path, b_->path);
+}
+
+// Files with known inode numbers come first, in inode order. The rest stay in
+// parent directory order.
+static int
+inode_comparator(const void *a, const void *b)
+{
+    const struct candidate *a_ = a;
+    const struct candidate *b_ = b;
+
+    if ((a_->ino == 0) != (b_->ino == 0))
+        return a_->ino == 0 ? 1 : -1;
+    if (a_->ino != b_->ino)
+        return a_->ino < b_->ino ? -1 : 1;
+    return (a_->order < b_->order) ? -1 : (a_->order > b_->order);
+}
+
+// Looks up inode numbers of candidates from a single directory by reading
+// that directory, which is much cheaper than a stat() per file.
+static void
+lookup_group_inodes(struct candidate *candidates, size_t count)
+{
+    struct name_entry *entries = xcalloc(count, sizeof(*entries));
+    struct name_entry *by_name = NULL;
+    const char *path = candidates[0].path;
+    size_t dir_len = candidates[0].dir_len;
+
+    for (size_t k = 0; k < count; k++) {
+        const char *name = candidates[k].path + candidates[k].dir_len;
+        if (name[0] == '/')
+            name += 1;
+        entries[k].candidate = &candidates[k];
+        HASH_ADD_KEYPTR(hh, by_name, name, strlen(name), &entries[k]);
+    }
+
+    char *dir_name = dir_len > 0 ? xstrndup(path, dir_len) : xstrdup(".");
+
+    DIR *dirp = opendir(dir_name);
+    if (dirp) {
+        struct dirent *de;
+        while ((de = readdir(dirp)) != NULL) {
+            struct name_entry *entry;
+            HASH_FIND_STR(by_name, de->d_name, entry);
+            if (entry)
+                entry->candidate->ino = de->d_ino;
         }
-        if (bytes_read <= 0) {
-            // Either an error (-1) or an EOF (0).
+        closedir(dirp);
+    }
+
+    HASH_CLEAR(hh, by_name);
+    free(dir_name);
+    free(entries);
+}
+
+static void *
+lookup_inodes_thread(void *param)
+{
+    struct mapper *m = param;
+
+    while (1) {
+        size_t k = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED);
+        if (k >= m->group_count)
             break;
-        }
-        to_read -= bytes_read;
-        ofs += bytes_read;
-        if (bytes_in_segment)
-            *bytes_in_segment += bytes_read;
+
+        lookup_group_inodes(&m->candidates[m->groups[k]],
+                            m->groups[k + 1] - m->groups[k]);
     }
-    close(fd);
+
+    return NULL;
 }
 
-int
-main(int argc, char *argv[])
+static void *
+map_files_thread(void *param)
 {
-    struct segment *segments = NULL;
+    struct mapper *m = param;
+    struct segment_plan local;
 
-    ensure_initialized();
+    segment_plan_init(&local);
 
-    encfs_mapper_force_refresh_mounts();
+    while (1) {
+        size_t k = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED);
+        if (k >= m->candidate_count)
+            break;
 
-    size_t total_segment_count = 0;
-    for (int k = 1; k < argc; k++) {
         size_t file_segment_count;
-        display_progress_throttled("mapping", k - 1, argc);
-        enumerate_file_segments(argv[k], &segments, &file_segment_count);
-        total_segment_count += file_segment_count;
+        enumerate_file_segments(m->pool, m->cache, m->candidates[k].path,
+                                &local, &file_segment_count);
+
+        pthread_mutex_lock(&m->lock);
+        segment_plan_move(m->plan, &local);
+        m->segment_count += file_segment_count;
+        m->mapped_count += 1;
+        display_progress_throttled("mapping", m->mapped_count,
+                                   m->candidate_count);
+        pthread_mutex_unlock(&m->lock);
     }
-    display_progress_unthrottled("mapping", argc, argc);
 
-    if (!isatty(fileno(stdin))) {
-        int file_count = argc;
-        char line[128 * 1024];
-
-        while (fgets(line, sizeof(line), stdin)) {
-            size_t line_len = strlen(line);
-            while (line_len > 0 && line[line_len - 1] == '\n') {
-                line[line_len - 1] = '\0';
-                line_len -= 1;
-            }
-            file_count += 1;
+    segment_plan_free(&local);
+    return NULL;
+}
 
-            size_t file_segment_count;
-            display_progress_throttled("mapping", file_count, file_count);
-            enumerate_file_segments(line, &segments, &file_segment_count);
-            total_segment_count += file_segment_count;
-        }
-        display_progress_unthrottled("mapping", file_count, file_count);
+// Runs |fn| on |jobs| threads, including the calling one.
+static void
+run_threads(unsigned jobs, void *(*fn)(void *), struct mapper *m)
+{
+    pthread_t *threads = xcalloc(jobs, sizeof(*threads));
+    unsigned started = 0;
+
+    m->next = 0;
+    for (unsigned k = 1; k < jobs; k++) {
+        if (pthread_create(&threads[started], NULL, fn, m) == 0)
+            started += 1;
     }
 
-    if (segments)
-        DL_SORT(segments, segment_comparator);
-    printf("\n");
+    fn(m);
 
-    size_t total_bytes_read = 0;
-    int count = 0;
-    for (struct segment *it = segments; it != NULL; it = it->next) {
-        size_t bytes_in_segment = 0;
+    for (unsigned k = 0; k < started; k++)
+        pthread_join(threads[k], NULL);
+    free(threads);
+}
+
+// Maps all candidates into |plan|. Files are opened in inode order where
+// inode numbers are known, as that's roughly the order of inode tables on
+// disk, and by several threads at once, so the kernel has more requests to
+// sort. Returns the number of segments.
+static size_t
+map_candidates(struct candidate *candidates, size_t count, unsigned jobs,
+               struct fd_pool *pool, struct extent_cache *cache,
+               struct segment_plan *plan)
+{
+    struct mapper m = {
+        .candidates = candidates,
+        .candidate_count = count,
+        .pool = pool,
+        .cache = cache,
+        .plan = plan,
+    };
+
+    pthread_mutex_init(&m.lock, NULL);
+
+    qsort(candidates, count, sizeof(*candidates), dir_comparator);
+
+    m.groups = xmalloc((count + 1) * sizeof(m.groups[0]));
+    for (size_t k = 0; k < count; k++) {
+        candidates[k].order = k;
+        if (k == 0 || !same_dir(&candidates[k - 1], &candidates[k]))
+            m.groups[m.group_count++] = k;
+    }
+    m.groups[m.group_count] = count;
+
+    run_threads(jobs, lookup_inodes_thread, &m);
+    qsort(candidates, count, sizeof(*candidates), inode_comparator);
+
+    run_threads(jobs, map_files_thread, &m);
+    display_progress_unthrottled("mapping", count, count);
+
+    free(m.groups);
+    pthread_mutex_destroy(&m.lock);
+    return m.segment_count;
+}
+
+// Reads all segments of |plan|. Returns the number of bytes read.
+static size_t
+read_plan(struct segment_plan *plan, size_t total_segment_count)
+{
+    struct segment_plan_reader *reader = segment_plan_reader_new(plan);
+    struct io_queue *queue = io_queue_new();
+    struct plan_segment seg;
+    size_t count = 0;
+
+    while (segment_plan_reader_next(reader, &seg)) {
         display_progress_throttled("reading", ++count, total_segment_count);
-        read_segment(it, &bytes_in_segment);
-        total_bytes_read += bytes_in_segment;
+        read_segment(queue, plan->files[seg.file_idx], &seg);
     }
+    segment_plan_reader_free(reader);
+
+    size_t total_bytes_read = io_queue_drain(queue);
+    io_queue_free(queue);
     display_progress_unthrottled("reading", total_segment_count,
                                  total_segment_count);
     printf("\n");
 
-    free_segment_list(&segments);
+    return total_bytes_read;
+}
+
+// Reads all segments of a saved plan. Files are looked up when their first
+// segment comes. With |revalidate|, files that changed since the plan was
+// made are skipped. Returns the number of bytes read.
+static size_t
+read_plan_file(const struct plan_file *pf, bool revalidate,
+               struct fd_pool *pool)
+{
+    struct pooled_file **files = xcalloc(pf->file_count, sizeof(*files));
+    bool *skipped = xcalloc(pf->file_count, sizeof(*skipped));
+    size_t skipped_count = 0;
+    struct io_queue *queue = io_queue_new();
+
+    for (size_t k = 0; k < pf->segment_count; k++) {
+        const struct plan_segment *seg = &pf->segments[k];
+        size_t idx = seg->file_idx;
+
+        display_progress_throttled("reading", k + 1, pf->segment_count);
+        if (idx >= pf->file_count || skipped[idx])
+            continue;
+
+        if (!files[idx]) {
+            const char *name = plan_file_name(pf, idx);
+            if (!name || (revalidate && !plan_file_revalidate(pf, idx))) {
+                skipped[idx] = true;
+                skipped_count += 1;
+                continue;
+            }
+            files[idx] = fd_pool_get(pool, name);
+        }
+
+        read_segment(queue, files[idx], seg);
+    }
+
+    size_t total_bytes_read = io_queue_drain(queue);
+    io_queue_free(queue);
+    display_progress_unthrottled("reading", pf->segment_count,
+                                 pf->segment_count);
+    printf("\n");
+
+    if (skipped_count > 0)
+        printf("skipped %zu changed or missing files\n", skipped_count);
+
+    for (size_t k = 0; k < pf->file_count; k++) {
+        if (files[k])
+            fd_pool_unref(files[k]);
+    }
+    free(files);
+    free(skipped);
+
+    return total_bytes_read;
+}
+
+// Reads a name delimited by |delim| from |fp| into |*line|. Returns false at
+// the end of input.
+static bool
+read_name(FILE *fp, int delim, char **line, size_t *line_size)
+{
+    while (1) {
+        ssize_t len = getdelim(line, line_size, delim, fp);
+        if (len < 0)
+            return false;
+
+        if (len > 0 && (*line)[len - 1] == delim)
+            (*line)[--len] = '\0';
+        if (len > 0)
+            return true;
+    }
+}
+
+// Returns the next name to map, or NULL when there are no more. Caller should
+// free() the result.
+static char *
+next_name(struct name_source *input)
+{
+    char *name = NULL;
+
+    pthread_mutex_lock(&input->lock);
+    if (input->next_name < input->name_count) {
+        name = xstrdup(input->names[input->next_name++]);
+    } else if (input->read_stdin) {
+        if (read_name(stdin, input->delim, &input->line, &input->line_size))
+            name = xstrdup(input->line);
+        else
+            input->read_stdin = false;
+    }
+    pthread_mutex_unlock(&input->lock);
+
+    return name;
+}
+
+static bool
+window_segment_less(const struct window_segment *a,
+                    const struct window_segment *b)
+{
+    return a->physical_pos < b->physical_pos;
+}
+
+static void
+heap_push(struct window_segment *heap, size_t *len, struct window_segment seg)
+{
+    size_t k = (*len)++;
+
+    while (k > 0 && window_segment_less(&seg, &heap[(k - 1) / 2])) {
+        heap[k] = heap[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    heap[k] = seg;
+}
+
+static struct window_segment
+heap_pop(struct window_segment *heap, size_t *len)
+{
+    struct window_segment top = heap[0];
+    struct window_segment last = heap[--(*len)];
+    size_t k = 0;
+
+    while (2 * k + 1 < *len) {
+        size_t child = 2 * k + 1;
+        if (child + 1 < *len &&
+            window_segment_less(&heap[child + 1], &heap[child]))
+            child += 1;
+        if (!window_segment_less(&heap[child], &last))
+            break;
+        heap[k] = heap[child];
+        k = child;
+    }
+    if (*len > 0)
+        heap[k] = last;
+
+    return top;
+}
+
+static void
+elevator_push(struct elevator *el, struct window_segment seg)
+{
+    if (seg.physical_pos >= el->head)
+        heap_push(el->ahead, &el->ahead_len, seg);
+    else
+        heap_push(el->behind, &el->behind_len, seg);
+}
+
+// Elevator must not be empty.
+static struct window_segment
+elevator_pop(struct elevator *el)
+{
+    if (el->ahead_len == 0) {
+        // Start the next sweep.
+        struct window_segment *tmp = el->ahead;
+        el->ahead = el->behind;
+        el->ahead_len = el->behind_len;
+        el->behind = tmp;
+        el->behind_len = 0;
+    }
+
+    struct window_segment seg = heap_pop(el->ahead, &el->ahead_len);
+    el->head = seg.physical_pos;
+    return seg;
+}
+
+// Moves segments of |plan| into the window, waiting for room as needed.
+static void
+push_to_window(struct streamer *st, struct segment_plan *plan)
+{
+    pthread_mutex_lock(&st->lock);
+
+    for (size_t k = 0; k < plan->count; k++) {
+        while (st->window_len == st->window_size)
+            pthread_cond_wait(&st->window_has_room, &st->lock);
+
+        struct window_segment seg = {
+            .physical_pos = plan->physical_pos[k],
+            .file_offset = plan->file_offset[k],
+            .extent_length = plan->extent_length[k],
+            .file = fd_pool_ref(plan->files[plan->file_idx[k]]),
+        };
+        elevator_push(&st->window, seg);
+        st->window_len += 1;
+        if (st->window_len == st->window_size)
+            pthread_cond_signal(&st->window_full);
+    }
+
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void *
+stream_map_thread(void *param)
+{
+    struct streamer *st = param;
+    struct segment_plan local;
+    char *name;
+
+    segment_plan_init(&local);
+
+    while ((name = next_name(st->input)) != NULL) {
+        enumerate_file_segments(st->pool, st->cache, name, &local, NULL);
+        push_to_window(st, &local);
+        segment_plan_free(&local);
+        free(name);
+    }
+
+    pthread_mutex_lock(&st->lock);
+    st->mappers_running -= 1;
+    pthread_cond_signal(&st->window_full);
+    pthread_mutex_unlock(&st->lock);
+
+    return NULL;
+}
+
+// Maps files as names arrive, and reads them at the same time. Segments wait
+// in a window of |window_size| segments, from which the ones next in elevator
+// order are read, once the window is full. Returns the number of bytes read.
+static size_t
+stream_files(struct name_source *input, unsigned jobs, size_t window_size,
+             struct fd_pool *pool)
+{
+    struct streamer st = {
+        .input = input,
+        .pool = pool,
+        .cache = extent_cache_open(),
+        .window_size = window_size,
+    };
+    pthread_t *threads = xcalloc(jobs, sizeof(*threads));
+    struct io_queue *queue = io_queue_new();
+    unsigned started = 0;
+    size_t read_count = 0;
+
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.window_full, NULL);
+    pthread_cond_init(&st.window_has_room, NULL);
+    st.window.ahead = xmalloc(window_size * sizeof(st.window.ahead[0]));
+    st.window.behind = xmalloc(window_size * sizeof(st.window.behind[0]));
+
+    pthread_mutex_lock(&st.lock);
+    for (unsigned k = 0; k < jobs; k++) {
+        if (pthread_create(&threads[started], NULL, stream_map_thread, &st) ==
+            0)
+            started += 1;
+    }
+    st.mappers_running = started;
+
+    while (1) {
+        while (st.window_len < st.window_size && st.mappers_running > 0)
+            pthread_cond_wait(&st.window_full, &st.lock);
+        if (st.window_len == 0)
+            break;
+
+        struct window_segment seg = elevator_pop(&st.window);
+        st.window_len -= 1;
+        pthread_cond_signal(&st.window_has_room);
+        size_t waiting_count = st.window_len;
+        pthread_mutex_unlock(&st.lock);
+
+        struct plan_segment ps = {
+            .physical_pos = seg.physical_pos,
+            .file_offset = seg.file_offset,
+            .extent_length = seg.extent_length,
+        };
+        read_segment(queue, seg.file, &ps);
+        fd_pool_unref(seg.file);
+        read_count += 1;
+        display_progress_throttled("reading", read_count,
+                                   read_count + waiting_count);
+
+        pthread_mutex_lock(&st.lock);
+    }
+    pthread_mutex_unlock(&st.lock);
+
+    for (unsigned k = 0; k < started; k++)
+        pthread_join(threads[k], NULL);
+
+    size_t total_bytes_read = io_queue_drain(queue);
+    io_queue_free(queue);
+    display_progress_unthrottled("reading", read_count, read_count);
+    printf("\n");
+
+    extent_cache_close(st.cache);
+    free(st.window.ahead);
+    free(st.window.behind);
+    pthread_cond_destroy(&st.window_full);
+    pthread_cond_destroy(&st.window_has_room);
+    pthread_mutex_destroy(&st.lock);
+    free(threads);
+
+    return total_bytes_read;
+}
+
+// Parses a number from 1 to |max|. Returns false if |str| is not one.
+static bool
+parse_count(const char *str, long max, long *value)
+{
+    char *end;
+
+    errno = 0;
+    long v = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || v < 1 || v > max)
+        return false;
+
+    *value = v;
+    return true;
+}
+
+static void
+print_usage(void)
+{
+    printf("Usage: precache [options] [file...]\n"
+           "File names are also read from stdin, one per line, or\n"
+           "NUL-separated with -0.\n"
+           "\n"
+           "  -j, --jobs=N         map up to N files at once (default: %d)\n"
+           "  -s, --stream         read while still mapping\n"
+           "  -w, --window=N       with --stream, choose reads from N\n"
+           "                       segments (default: %d)\n"
+           "  -0, --null           names on stdin end with NUL, not newline\n"
+           "  -o, --plan-out=FILE  save the plan to FILE instead of reading\n"
+           "  -i, --plan-in=FILE   read files as planned in FILE, without\n"
+           "                       mapping\n"
+           "      --revalidate     with --plan-in, skip files that changed\n"
+           "  -h, --help           show this help\n",
+           DEFAULT_JOBS, DEFAULT_WINDOW);
+}
+
+// Maps |names| and files listed on stdin, and either reads them, or saves the
+// plan to |plan_out|. Returns 0 on success.
+static int
+map_files(char **names, size_t name_count, int delim, unsigned jobs,
+          const char *plan_out, struct fd_pool *pool,
+          size_t *total_bytes_read)
+{
+    struct segment_plan plan;
+    struct candidate *candidates = NULL;
+    size_t candidate_count = 0;
+    size_t candidates_capacity = 0;
+    int ret = 0;
+
+    segment_plan_init(&plan);
+
+    // Plans of whole filesystems may not fit into memory.
+    segment_plan_limit_memory(&plan, segment_plan_memory_limit());
+
+    for (size_t k = 0; k < name_count; k++) {
+        add_candidate(&candidates, &candidate_count, &candidates_capacity,
+                      names[k]);
+    }
+
+    if (!isatty(fileno(stdin))) {
+        char *line = NULL;
+        size_t line_size = 0;
+
+        while (read_name(stdin, delim, &line, &line_size)) {
+            add_candidate(&candidates, &candidate_count, &candidates_capacity,
+                          line);
+        }
+        free(line);
+    }
+
+    struct extent_cache *cache = extent_cache_open();
+    size_t total_segment_count =
+        map_candidates(candidates, candidate_count, jobs, pool, cache, &plan);
+    extent_cache_close(cache);
+
+    for (size_t k = 0; k < candidate_count; k++)
+        free(candidates[k].path);
+    free(candidates);
+
+    printf("\n");
+
+    if (plan_out) {
+        if (plan_file_write(&plan, plan_out) == 0) {
+            printf("plan saved to %s: %zu files, %zu segments\n", plan_out,
+                   plan.file_count, total_segment_count);
+        } else {
+            fprintf(stderr, "Error: can't write plan file %s\n", plan_out);
+            ret = 1;
+        }
+    } else {
+        *total_bytes_read = read_plan(&plan, total_segment_count);
+    }
+
+    segment_plan_free(&plan);
+    return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"stream", no_argument, NULL, 's'},
+        {"window", required_argument, NULL, 'w'},
+        {"null", no_argument, NULL, '0'},
+        {"plan-out", required_argument, NULL, 'o'},
+        {"plan-in", required_argument, NULL, 'i'},
+        {"revalidate", no_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {},
+    };
+    unsigned jobs = DEFAULT_JOBS;
+    bool stream = false;
+    size_t window_size = DEFAULT_WINDOW;
+    int delim = '\n';
+    const char *plan_out = NULL;
+    const char *plan_in = NULL;
+    bool revalidate = false;
+    long count;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "j:sw:0o:i:h", long_options,
+                              NULL)) != -1)  //
+    {
+        switch (opt) {
+        case 'j':
+            if (!parse_count(optarg, MAX_JOBS, &count)) {
+                fprintf(stderr, "Error: jobs must be from 1 to %d\n",
+                        MAX_JOBS);
+                print_usage();
+                return 2;
+            }
+            jobs = count;
+            break;
+        case 's':
+            stream = true;
+            break;
+        case 'w':
+            if (!parse_count(optarg, MAX_WINDOW, &count)) {
+                fprintf(stderr, "Error: window must be from 1 to %d\n",
+                        MAX_WINDOW);
+                print_usage();
+                return 2;
+            }
+            window_size = count;
+            break;
+        case '0':
+            delim = '\0';
+            break;
+        case 'o':
+            plan_out = optarg;
+            break;
+        case 'i':
+            plan_in = optarg;
+            break;
+        case 'r':
+            revalidate = true;
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        default:
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (plan_in && (plan_out || stream || optind < argc)) {
+        fprintf(stderr, "Error: --plan-in doesn't take file names\n");
+        return 2;
+    }
+
+    if (stream && plan_out) {
+        fprintf(stderr, "Error: --stream doesn't make a plan to save\n");
+        return 2;
+    }
+
+    ensure_initialized();
+
+    // Files stay open between mapping and reading, as long as there is room.
+    struct fd_pool *pool = fd_pool_new(2);
+    size_t total_bytes_read = 0;
+    int ret = 0;
+
+    if (plan_in) {
+        struct plan_file *pf = plan_file_open(plan_in);
+        if (!pf) {
+            fprintf(stderr, "Error: can't read plan file %s\n", plan_in);
+            fd_pool_free(pool);
+            return 1;
+        }
+        total_bytes_read = read_plan_file(pf, revalidate, pool);
+        plan_file_close(pf);
+    } else if (stream) {
+        struct name_source input = {
+            .names = argv + optind,
+            .name_count = argc - optind,
+            .read_stdin = !isatty(fileno(stdin)),
+            .delim = delim,
+        };
+
+        pthread_mutex_init(&input.lock, NULL);
+        encfs_mapper_force_refresh_mounts();
+        total_bytes_read = stream_files(&input, jobs, window_size, pool);
+        pthread_mutex_destroy(&input.lock);
+        free(input.line);
+    } else {
+        encfs_mapper_force_refresh_mounts();
+        ret = map_files(argv + optind, argc - optind, delim, jobs, plan_out,
+                        pool, &total_bytes_read);
+    }
+
+    fd_pool_free(pool);
+
+    if (plan_out)
+        return ret;
 
     const size_t one_MiB = 1024 * 1024;
     printf("total data read: %zu MiB (%zu B)\n",
            (total_bytes_read + one_MiB - 1) / one_MiB, total_bytes_read);
 
-    return 0;
+    return ret;
 }
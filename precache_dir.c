@@ -3,6 +3,7 @@
 
 #define _GNU_SOURCE
 #include "intercepted_functions.h"
+#include "io_queue.h"
 #include "mem.h"
 #include "progress.h"
 #include "segments.h"
@@ -10,15 +11,22 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <utlist.h>
 #include <utstring.h>
 
+#define DEFAULT_COALESCE_GAP_KIB 128
+#define DEFAULT_MAX_REQUEST_KIB 512
+
 struct scan_task {
     char *dir_name;
     struct scan_task *prev, *next;
@@ -32,6 +40,75 @@ struct linux_dirent64 {
     char d_name[];
 };
 
+// Directory of a tree level. It's derived once its segments are read, as
+// getdents64() then finds its blocks in the page cache.
+struct level_dir {
+    char *name;
+    size_t unread;  // Segments not read yet.
+};
+
+// Directories of a tree level, and segments to read for them.
+struct level_plan {
+    struct segment_plan plan;
+    struct level_dir *dirs;
+    size_t dir_count;
+    size_t dirs_capacity;
+    size_t *file_dirs;  // Directory index for each file of |plan|.
+    size_t file_dirs_capacity;
+
+    // Directories with all segments read, in order of completion. Guarded by
+    // the pipeline lock once the level is queued.
+    size_t *ready;
+    size_t ready_count;
+    size_t taken_count;
+    bool read_done;
+};
+
+struct read_pipeline;
+
+// Merges overlapping and nearby ranges of the raw device into larger reads.
+// Reading a small gap costs less than a seek and one more request. Ranges
+// must come in ascending order.
+struct coalescer {
+    struct io_queue *queue;
+    int fd;
+    uint64_t gap;
+    uint64_t max_request;
+    uint64_t block_size;
+    uint64_t start;
+    uint64_t end;  // Equals to |start| if there is no pending range.
+
+    // Directories of segments in the pending range, one entry per segment.
+    struct read_pipeline *pipeline;
+    struct level_plan *level;
+    size_t *members;
+    size_t member_count;
+    size_t members_capacity;
+};
+
+// Merged read, and directories whose segments it covers.
+struct coalesced_read {
+    struct read_pipeline *pipeline;
+    struct level_plan *level;
+    size_t count;
+    size_t dirs[];
+};
+
+// Reads a level on a separate thread. Directories are handed back as their
+// reads complete, so the main thread derives and maps the next level while
+// the disk is still busy with the rest of the current one.
+struct read_pipeline {
+    pthread_t thread;
+    struct io_queue *queue;
+    struct coalescer coalescer;
+    size_t total_bytes_read;  // Owned by the reading thread until joined.
+
+    pthread_mutex_t lock;  // Guards everything below, and queued levels.
+    pthread_cond_t changed;
+    struct level_plan *level;  // Level waiting for the reading thread.
+    bool finished;
+};
+
 static void
 free_task_list(struct scan_task **tasks)
 {
@@ -51,35 +128,6 @@ append_task(struct scan_task **tasks, const char *dir_name)
     DL_APPEND(*tasks, t);
 }
 
-static void
-read_segment(int fd, struct segment *seg, size_t *bytes_in_segment)
-{
-    static char buf[512 * 1024];
-    ssize_t to_read = seg->extent_length;
-    off_t ofs = seg->physical_pos;
-
-    if (bytes_in_segment)
-        *bytes_in_segment = 0;
-
-    while (to_read > 0) {
-        ssize_t chunk_sz =
-            to_read < (ssize_t)sizeof(buf) ? to_read : (ssize_t)sizeof(buf);
-        ssize_t bytes_read = pread(fd, buf, chunk_sz, ofs);
-        if (bytes_read == -1 && errno == EINTR) {
-            // Try again.
-            continue;
-        }
-        if (bytes_read <= 0) {
-            // Either an error (-1) or an EOF (0).
-            break;
-        }
-        to_read -= bytes_read;
-        ofs += bytes_read;
-        if (bytes_in_segment)
-            *bytes_in_segment += bytes_read;
-    }
-}
-
 static void
 derive_new_tasks(const char *dir_name, dev_t root_dir_st_dev,
                  struct scan_task **next_tasks)
@@ -142,18 +190,6 @@ derive_new_tasks(const char *dir_name, dev_t root_dir_st_dev,
     close(dir_fd);
 }
 
-static size_t
-get_task_count(struct scan_task *task_list)
-{
-    size_t count = 0;
-    struct scan_task *task = task_list;
-    while (task != NULL) {
-        count++;
-        task = task->next;
-    }
-    return count;
-}
-
 static int
 common_prefix_length(const char *s1, const char *s2)
 {
@@ -212,6 +248,325 @@ err:
     return selected_device_path;
 }
 
+// Reads a number from the queue directory of block device |dev| in sysfs.
+// Partitions use the queue of their disk. Returns 0 on failure.
+static uint64_t
+get_queue_param(dev_t dev, const char *name)
+{
+    static const char *const templates[] = {
+        "/sys/dev/block/%u:%u/queue/%s",
+        "/sys/dev/block/%u:%u/../queue/%s",
+    };
+    uint64_t value = 0;
+    UT_string path;
+    UT_string body;
+
+    utstring_init(&path);
+    utstring_init(&body);
+
+    for (size_t k = 0; k < sizeof(templates) / sizeof(templates[0]); k++) {
+        utstring_clear(&path);
+        utstring_printf(&path, templates[k], major(dev), minor(dev), name);
+        if (file_get_contents(utstring_body(&path), &body) == 0) {
+            value = strtoull(utstring_body(&body), NULL, 10);
+            break;
+        }
+    }
+
+    utstring_done(&body);
+    utstring_done(&path);
+    return value;
+}
+
+static void
+coalescer_init(struct coalescer *c, struct io_queue *queue, int fd)
+{
+    uint64_t max_sectors_kib = 0;
+    uint64_t optimal_io_size = 0;
+    struct stat sb;
+
+    memset(c, 0, sizeof(*c));
+    c->queue = queue;
+    c->fd = fd;
+    c->gap = DEFAULT_COALESCE_GAP_KIB * 1024;
+    c->block_size = 512;
+
+    if (fstat(fd, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+        max_sectors_kib = get_queue_param(sb.st_rdev, "max_sectors_kb");
+        optimal_io_size = get_queue_param(sb.st_rdev, "optimal_io_size");
+        uint64_t block_size =
+            get_queue_param(sb.st_rdev, "logical_block_size");
+        if (block_size > 0)
+            c->block_size = block_size;
+    }
+
+    c->max_request = max_sectors_kib > 0 ? max_sectors_kib * 1024
+                                         : DEFAULT_MAX_REQUEST_KIB * 1024;
+
+    const char *env_PRECACHE_COALESCE_GAP = getenv("PRECACHE_COALESCE_GAP");
+    if (env_PRECACHE_COALESCE_GAP)
+        c->gap = strtoull(env_PRECACHE_COALESCE_GAP, NULL, 10) * 1024;
+
+    const char *env_PRECACHE_MAX_REQUEST = getenv("PRECACHE_MAX_REQUEST");
+    if (env_PRECACHE_MAX_REQUEST)
+        c->max_request = strtoull(env_PRECACHE_MAX_REQUEST, NULL, 10) * 1024;
+
+    // Requests of a whole number of optimal I/O units don't straddle stripes
+    // more than necessary.
+    if (optimal_io_size > 0 && c->max_request >= optimal_io_size)
+        c->max_request -= c->max_request % optimal_io_size;
+    if (c->max_request < c->block_size)
+        c->max_request = c->block_size;
+}
+
+// Marks segments of a merged read as read. Called on the reading thread.
+static void
+coalesced_read_done(void *arg)
+{
+    struct coalesced_read *r = arg;
+    struct level_plan *level = r->level;
+
+    pthread_mutex_lock(&r->pipeline->lock);
+    for (size_t k = 0; k < r->count; k++) {
+        if (--level->dirs[r->dirs[k]].unread == 0)
+            level->ready[level->ready_count++] = r->dirs[k];
+    }
+    pthread_cond_broadcast(&r->pipeline->changed);
+    pthread_mutex_unlock(&r->pipeline->lock);
+
+    free(r);
+}
+
+static void
+coalescer_flush(struct coalescer *c)
+{
+    if (c->end > c->start) {
+        struct coalesced_read *r = xmalloc(
+            sizeof(*r) + c->member_count * sizeof(c->members[0]));
+        r->pipeline = c->pipeline;
+        r->level = c->level;
+        r->count = c->member_count;
+        memcpy(r->dirs, c->members, c->member_count * sizeof(c->members[0]));
+        io_queue_submit(c->queue, c->fd, c->start, c->end - c->start,
+                        coalesced_read_done, r);
+    }
+    c->start = c->end = 0;
+    c->member_count = 0;
+}
+
+static void
+coalescer_add_member(struct coalescer *c, size_t dir_idx)
+{
+    if (c->member_count == c->members_capacity) {
+        c->members_capacity = c->members_capacity ? c->members_capacity * 2
+                                                  : 64;
+        c->members =
+            xrealloc(c->members, c->members_capacity * sizeof(c->members[0]));
+    }
+    c->members[c->member_count++] = dir_idx;
+}
+
+// Adds a segment of directory |dir_idx|.
+static void
+coalescer_add(struct coalescer *c, uint64_t pos, uint64_t length,
+              size_t dir_idx)
+{
+    uint64_t end = pos + length;
+
+    // Raw device reads are done in whole logical blocks anyway.
+    pos -= pos % c->block_size;
+    end += (c->block_size - end % c->block_size) % c->block_size;
+
+    if (c->end > c->start && pos <= c->end + c->gap) {
+        uint64_t merged_end = end > c->end ? end : c->end;
+        if (merged_end - c->start <= c->max_request) {
+            c->end = merged_end;
+            coalescer_add_member(c, dir_idx);
+            return;
+        }
+    }
+
+    // Part that overlaps the pending range is read with it.
+    uint64_t pending_end = c->end;
+    coalescer_flush(c);
+    c->start = pos > pending_end ? pos : pending_end;
+    c->end = end;
+    coalescer_add_member(c, dir_idx);
+}
+
+static struct level_plan *
+level_plan_new(void)
+{
+    struct level_plan *level = xcalloc(1, sizeof(*level));
+
+    segment_plan_init(&level->plan);
+    segment_plan_limit_memory(&level->plan, segment_plan_memory_limit());
+    return level;
+}
+
+static void
+level_plan_free(struct level_plan *level)
+{
+    for (size_t k = 0; k < level->dir_count; k++)
+        free(level->dirs[k].name);
+    free(level->dirs);
+    free(level->file_dirs);
+    free(level->ready);
+    segment_plan_free(&level->plan);
+    free(level);
+}
+
+// Adds directory |dir_name| to |level|, with its segments.
+static void
+level_plan_add_dir(struct level_plan *level, struct fd_pool *pool,
+                   struct extent_cache *cache, const char *dir_name)
+{
+    size_t file_count = level->plan.file_count;
+    size_t segment_count = 0;
+
+    enumerate_file_segments(pool, cache, dir_name, &level->plan,
+                            &segment_count);
+
+    if (level->dir_count == level->dirs_capacity) {
+        level->dirs_capacity =
+            level->dirs_capacity ? level->dirs_capacity * 2 : 16;
+        level->dirs = xrealloc(level->dirs,
+                               level->dirs_capacity * sizeof(level->dirs[0]));
+    }
+
+    size_t dir_idx = level->dir_count++;
+    level->dirs[dir_idx].name = xstrdup(dir_name);
+    level->dirs[dir_idx].unread = 0;
+
+    if (level->plan.file_count == file_count) {
+        // Directory couldn't be opened. There is nothing to wait for.
+        return;
+    }
+
+    if (level->plan.file_count > level->file_dirs_capacity) {
+        level->file_dirs_capacity = level->plan.file_count * 2;
+        level->file_dirs =
+            xrealloc(level->file_dirs,
+                     level->file_dirs_capacity * sizeof(level->file_dirs[0]));
+    }
+    level->file_dirs[file_count] = dir_idx;
+    level->dirs[dir_idx].unread = segment_count;
+}
+
+static void *
+read_pipeline_thread(void *param)
+{
+    struct read_pipeline *p = param;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->level && !p->finished)
+            pthread_cond_wait(&p->changed, &p->lock);
+        if (!p->level)
+            break;
+
+        struct level_plan *level = p->level;
+        p->level = NULL;
+        pthread_mutex_unlock(&p->lock);
+
+        // Sort and read data from the raw device, merging nearby segments.
+        struct segment_plan_reader *reader =
+            segment_plan_reader_new(&level->plan);
+        struct plan_segment seg;
+        p->coalescer.level = level;
+        while (segment_plan_reader_next(reader, &seg)) {
+            coalescer_add(&p->coalescer, seg.physical_pos, seg.extent_length,
+                          level->file_dirs[seg.file_idx]);
+        }
+        coalescer_flush(&p->coalescer);
+        segment_plan_reader_free(reader);
+        p->total_bytes_read += io_queue_drain(p->queue);
+
+        pthread_mutex_lock(&p->lock);
+        level->read_done = true;
+        pthread_cond_broadcast(&p->changed);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static bool
+read_pipeline_start(struct read_pipeline *p, int raw_device_fd)
+{
+    memset(p, 0, sizeof(*p));
+    p->queue = io_queue_new();
+    coalescer_init(&p->coalescer, p->queue, raw_device_fd);
+    p->coalescer.pipeline = p;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+
+    if (pthread_create(&p->thread, NULL, read_pipeline_thread, p) != 0) {
+        pthread_cond_destroy(&p->changed);
+        pthread_mutex_destroy(&p->lock);
+        io_queue_free(p->queue);
+        return false;
+    }
+
+    return true;
+}
+
+// Queues |level| for reading. Directories with nothing to read are ready
+// right away. Only one level is read at a time, as the next one is derived
+// from the directories of this one.
+static void
+read_pipeline_push(struct read_pipeline *p, struct level_plan *level)
+{
+    level->ready = xmalloc((level->dir_count + 1) * sizeof(level->ready[0]));
+
+    pthread_mutex_lock(&p->lock);
+    for (size_t k = 0; k < level->dir_count; k++) {
+        if (level->dirs[k].unread == 0)
+            level->ready[level->ready_count++] = k;
+    }
+    p->level = level;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Waits for the next directory of |level| with all segments read, and stores
+// its index in |*dir_idx|. Returns false once all directories were returned.
+static bool
+read_pipeline_next_dir(struct read_pipeline *p, struct level_plan *level,
+                       size_t *dir_idx)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&p->lock);
+    while (level->taken_count == level->ready_count && !level->read_done)
+        pthread_cond_wait(&p->changed, &p->lock);
+    if (level->taken_count < level->ready_count) {
+        *dir_idx = level->ready[level->taken_count++];
+        found = true;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return found;
+}
+
+// Stops the reading thread. Returns the number of bytes read.
+static size_t
+read_pipeline_finish(struct read_pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->finished = true;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(p->thread, NULL);
+    io_queue_free(p->queue);
+    free(p->coalescer.members);
+    pthread_cond_destroy(&p->changed);
+    pthread_mutex_destroy(&p->lock);
+
+    return p->total_bytes_read;
+}
+
 static void
 make_readable_by_everyone(const char *path)
 {
@@ -273,65 +628,56 @@ main(int argc, char *argv[])
     dev_t root_dir_st_dev = sb.st_dev;
     size_t total_bytes_read = 0;
 
-    struct scan_task *current_tasks = NULL;
-    append_task(&current_tasks, root_dir);
-
-    while (current_tasks != NULL) {
-        struct segment *segments = NULL;
-        size_t segment_count = 0;
-        size_t task_idx = 0;
-
-        size_t current_task_count = get_task_count(current_tasks);
-
-        // Enumerate segments of all currently processed directories.
-        for (struct scan_task *task = current_tasks; task != NULL;
-             task = task->next)  //
-        {
-            size_t file_segment_count = 0;
-            enumerate_file_segments(task->dir_name, &segments,
-                                    &file_segment_count);
-            segment_count += file_segment_count;
-            display_progress_throttled("mapping directories", ++task_idx,
-                                       current_task_count);
-        }
-        display_progress_unthrottled("mapping directories", current_task_count,
-                                     current_task_count);
-        printf("\n");
+    struct read_pipeline pipeline;
+    if (!read_pipeline_start(&pipeline, raw_device_fd)) {
+        fprintf(stderr, "Error: can't start reading thread\n");
+        close(raw_device_fd);
+        goto err;
+    }
 
-        // Sort and read data from the raw device.
-        DL_SORT(segments, segment_comparator);
-        size_t segment_idx = 0;
-        for (struct segment *seg = segments; seg != NULL; seg = seg->next) {
-            size_t bytes_in_segment = 0;
-            read_segment(raw_device_fd, seg, &bytes_in_segment);
-            display_progress_throttled("reading raw device", ++segment_idx,
-                                       segment_count);
-            total_bytes_read += bytes_in_segment;
-        }
-        display_progress_unthrottled("reading raw device", segment_count,
-                                     segment_count);
-        printf("\n");
+    struct fd_pool *pool = fd_pool_new(2);
+    struct extent_cache *cache = extent_cache_open();
+    struct level_plan *level = level_plan_new();
+
+    level_plan_add_dir(level, pool, cache, root_dir);
 
-        free_segment_list(&segments);
+    while (level->dir_count > 0) {
+        struct level_plan *next_level = level_plan_new();
+        size_t derived_count = 0;
+        size_t dir_idx;
+
+        read_pipeline_push(&pipeline, level);
+
+        // Directories are derived as soon as their blocks are read, and their
+        // subdirectories are mapped, while the rest of the level is still
+        // being read.
+        while (read_pipeline_next_dir(&pipeline, level, &dir_idx)) {
+            struct scan_task *new_tasks = NULL;
+
+            derive_new_tasks(level->dirs[dir_idx].name, root_dir_st_dev,
+                             &new_tasks);
+            for (struct scan_task *task = new_tasks; task != NULL;
+                 task = task->next)  //
+            {
+                level_plan_add_dir(next_level, pool, cache, task->dir_name);
+            }
+            free_task_list(&new_tasks);
 
-        struct scan_task *next_tasks = NULL;
-        task_idx = 0;
-        for (struct scan_task *task = current_tasks; task != NULL;
-             task = task->next)  //
-        {
-            derive_new_tasks(task->dir_name, root_dir_st_dev, &next_tasks);
-            display_progress_throttled("deriving new tasks", ++task_idx,
-                                       current_task_count);
+            display_progress_throttled("scanning directories",
+                                       ++derived_count, level->dir_count);
         }
-        display_progress_unthrottled("deriving new tasks", current_task_count,
-                                     current_task_count);
+        display_progress_unthrottled("scanning directories", level->dir_count,
+                                     level->dir_count);
         printf("\n");
 
-        free_task_list(&current_tasks);
-        current_tasks = next_tasks;
+        level_plan_free(level);
+        level = next_level;
     }
 
-    free_task_list(&current_tasks);
+    level_plan_free(level);
+    total_bytes_read = read_pipeline_finish(&pipeline);
+    fd_pool_free(pool);
+    extent_cache_close(cache);
 
     const size_t one_MiB = 1024 * 1024;
     printf("total data read: %zu MiB (%zu B)\n",
@@ -0,0 +1,293 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include "read_engine.h"
+#include "intercepted_functions.h"
+#include "mem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+#define SCRATCH_SIZE (512 * 1024)
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static enum read_engine engine = READ_ENGINE_PREAD;
+static bool noatime_allowed = true;
+
+// Per-thread resources. Several threads may warm up files at once. They are
+// released when the thread exits.
+struct thread_resources {
+    char *scratch;
+    int splice_pipe[2];
+    int dev_null_fd;
+};
+
+static pthread_once_t resources_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t resources_key;
+static __thread struct thread_resources *resources = NULL;
+
+static void
+free_thread_resources(void *arg)
+{
+    struct thread_resources *res = arg;
+
+    free(res->scratch);
+    if (res->splice_pipe[0] >= 0) {
+        real_close(res->splice_pipe[0]);
+        real_close(res->splice_pipe[1]);
+    }
+    if (res->dev_null_fd >= 0)
+        real_close(res->dev_null_fd);
+    free(res);
+}
+
+static void
+create_resources_key(void)
+{
+    pthread_key_create(&resources_key, free_thread_resources);
+}
+
+static struct thread_resources *
+get_thread_resources(void)
+{
+    if (resources)
+        return resources;
+
+    pthread_once(&resources_key_once, create_resources_key);
+
+    resources = xcalloc(1, sizeof(*resources));
+    resources->splice_pipe[0] = -1;
+    resources->splice_pipe[1] = -1;
+    resources->dev_null_fd = -1;
+    pthread_setspecific(resources_key, resources);
+    return resources;
+}
+
+static void
+select_engine(void)
+{
+    static const struct {
+        const char *name;
+        enum read_engine engine;
+    } engines[] = {
+        {"pread", READ_ENGINE_PREAD},     {"readahead", READ_ENGINE_READAHEAD},
+        {"fadvise", READ_ENGINE_FADVISE}, {"madvise", READ_ENGINE_MADVISE},
+        {"splice", READ_ENGINE_SPLICE},   {"io_uring", READ_ENGINE_IO_URING},
+    };
+
+    const char *env_PRECACHE_READ_ENGINE = getenv("PRECACHE_READ_ENGINE");
+    if (!env_PRECACHE_READ_ENGINE)
+        return;
+
+    for (size_t k = 0; k < sizeof(engines) / sizeof(engines[0]); k++) {
+        if (strcmp(env_PRECACHE_READ_ENGINE, engines[k].name) == 0)
+            engine = engines[k].engine;
+    }
+}
+
+enum read_engine
+read_engine_get(void)
+{
+    pthread_once(&engine_once, select_engine);
+    return engine;
+}
+
+int
+read_engine_open(const char *path)
+{
+    if (__atomic_load_n(&noatime_allowed, __ATOMIC_RELAXED)) {
+        int fd = real_open(path, O_RDONLY | O_NOATIME | O_CLOEXEC);
+        if (fd >= 0 || errno != EPERM)
+            return fd;
+
+        // Only the owner may use O_NOATIME. Files of other users are likely
+        // to be all around, so it's not tried again.
+        __atomic_store_n(&noatime_allowed, false, __ATOMIC_RELAXED);
+    }
+
+    return real_open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static uint64_t
+populate_pread(int fd, uint64_t offset, uint64_t length)
+{
+    uint64_t done = 0;
+
+    struct thread_resources *res = get_thread_resources();
+    if (!res->scratch)
+        res->scratch = xmalloc(SCRATCH_SIZE);
+
+    while (done < length) {
+        size_t chunk_sz =
+            length - done < SCRATCH_SIZE ? length - done : SCRATCH_SIZE;
+        ssize_t bytes_read = pread(fd, res->scratch, chunk_sz, offset + done);
+        if (bytes_read == -1 && errno == EINTR) {
+            // Try again.
+            continue;
+        }
+        if (bytes_read <= 0) {
+            // Either an error (-1) or an EOF (0).
+            break;
+        }
+        done += bytes_read;
+    }
+
+    return done;
+}
+
+// Maps the range, with the start aligned down to a page boundary. Returns
+// MAP_FAILED on failure.
+static void *
+map_range(int fd, uint64_t offset, uint64_t length, size_t *map_len,
+          size_t *skip)
+{
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t map_start = offset & ~(page_size - 1);
+
+    *skip = offset - map_start;
+    *map_len = *skip + length;
+    return mmap(NULL, *map_len, PROT_READ, MAP_SHARED, fd, map_start);
+}
+
+// Counts pages of the range which are in the page cache.
+static uint64_t
+count_resident(int fd, uint64_t offset, uint64_t length)
+{
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    size_t map_len;
+    size_t skip;
+    uint64_t resident = 0;
+
+    void *addr = map_range(fd, offset, length, &map_len, &skip);
+    if (addr == MAP_FAILED)
+        return 0;
+
+    size_t page_count = (map_len + page_size - 1) / page_size;
+    unsigned char *vec = xmalloc(page_count);
+    if (mincore(addr, map_len, vec) == 0) {
+        for (size_t k = 0; k < page_count; k++) {
+            if (vec[k] & 1)
+                resident += page_size;
+        }
+    }
+
+    free(vec);
+    munmap(addr, map_len);
+
+    // First page may be partially before the range, the last one after it.
+    return resident < length ? resident : length;
+}
+
+static uint64_t
+populate_readahead(int fd, uint64_t offset, uint64_t length)
+{
+    if (readahead(fd, offset, length) != 0)
+        return populate_pread(fd, offset, length);
+    return length;
+}
+
+static uint64_t
+populate_fadvise(int fd, uint64_t offset, uint64_t length)
+{
+    if (posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED) != 0)
+        return populate_pread(fd, offset, length);
+    return length;
+}
+
+static uint64_t
+populate_madvise(int fd, uint64_t offset, uint64_t length)
+{
+    size_t map_len;
+    size_t skip;
+
+    void *addr = map_range(fd, offset, length, &map_len, &skip);
+    if (addr == MAP_FAILED)
+        return populate_pread(fd, offset, length);
+
+    int res = madvise(addr, map_len, MADV_POPULATE_READ);
+    munmap(addr, map_len);
+
+    // Kernels before 5.14 don't know MADV_POPULATE_READ. Range past the end of
+    // the file gives EFAULT, the rest of the range is populated by then.
+    if (res != 0 && errno != EFAULT)
+        return populate_pread(fd, offset, length);
+    return res == 0 ? length : count_resident(fd, offset, length);
+}
+
+static uint64_t
+populate_splice(int fd, uint64_t offset, uint64_t length)
+{
+    uint64_t done = 0;
+
+    struct thread_resources *res = get_thread_resources();
+    if (res->splice_pipe[0] < 0 && pipe2(res->splice_pipe, O_CLOEXEC) != 0)
+        return populate_pread(fd, offset, length);
+
+    if (res->dev_null_fd < 0) {
+        res->dev_null_fd = real_open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (res->dev_null_fd < 0)
+            return populate_pread(fd, offset, length);
+    }
+
+    while (done < length) {
+        loff_t ofs = offset + done;
+        ssize_t spliced = splice(fd, &ofs, res->splice_pipe[1], NULL,
+                                 length - done, SPLICE_F_MOVE);
+        if (spliced == -1 && errno == EINTR) {
+            // Try again.
+            continue;
+        }
+        if (spliced == -1 && done == 0)
+            return populate_pread(fd, offset, length);
+        if (spliced <= 0)
+            break;
+
+        // Drain the pipe. Pages are not copied, only references are moved.
+        ssize_t left = spliced;
+        while (left > 0) {
+            ssize_t drained = splice(res->splice_pipe[0], NULL,
+                                     res->dev_null_fd, NULL, left,
+                                     SPLICE_F_MOVE);
+            if (drained == -1 && errno == EINTR)
+                continue;
+            if (drained <= 0)
+                return done;
+            left -= drained;
+        }
+
+        done += spliced;
+    }
+
+    return done;
+}
+
+uint64_t
+read_engine_populate(int fd, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+        return 0;
+
+    switch (read_engine_get()) {
+    case READ_ENGINE_READAHEAD:
+        return populate_readahead(fd, offset, length);
+    case READ_ENGINE_FADVISE:
+        return populate_fadvise(fd, offset, length);
+    case READ_ENGINE_MADVISE:
+        return populate_madvise(fd, offset, length);
+    case READ_ENGINE_SPLICE:
+        return populate_splice(fd, offset, length);
+    case READ_ENGINE_PREAD:
+    case READ_ENGINE_IO_URING:
+    default:
+        return populate_pread(fd, offset, length);
+    }
+}
@@ -0,0 +1,36 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdint.h>
+
+// Ways to bring file data into the page cache. All but READ_ENGINE_PREAD and
+// READ_ENGINE_IO_URING do that without copying data into userspace. Engines
+// not supported by the kernel fall back to READ_ENGINE_PREAD.
+enum read_engine {
+    READ_ENGINE_PREAD,      // pread() into a scratch buffer.
+    READ_ENGINE_READAHEAD,  // readahead(2). Doesn't wait for data.
+    READ_ENGINE_FADVISE,    // POSIX_FADV_WILLNEED. Doesn't wait for data.
+    READ_ENGINE_MADVISE,    // mmap() and MADV_POPULATE_READ.
+    READ_ENGINE_SPLICE,     // splice() through a pipe to /dev/null.
+    READ_ENGINE_IO_URING,   // Reads kept in flight by a read_queue.
+};
+
+// Engine selected by PRECACHE_READ_ENGINE: "pread", "readahead", "fadvise",
+// "madvise", "splice", or "io_uring". Default is "pread".
+enum read_engine
+read_engine_get(void);
+
+// Opens |path| for warming up. O_NOATIME is used where allowed, so reads
+// don't cause atime updates. Descriptors are close-on-exec, as the library
+// keeps them open in the host process.
+int
+read_engine_open(const char *path);
+
+// Brings |length| bytes at |offset| of |fd| into the page cache. Returns the
+// number of bytes that were brought in, or requested to be, for engines that
+// don't wait for data. Single reads of the io_uring engine
+// are done with pread().
+uint64_t
+read_engine_populate(int fd, uint64_t offset, uint64_t length);
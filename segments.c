@@ -3,22 +3,518 @@
 
 #include "segments.h"
 #include "encfs_mapper.h"
+#include "extent_cache.h"
 #include "mem.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <utlist.h>
+#include <utstring.h>
+
+// Memory taken by a segment in a plan.
+#define SEGMENT_BYTES (3 * sizeof(uint64_t) + sizeof(uint32_t))
+
+#define DEFAULT_PLAN_MEMORY_MIB 256
+
+// Segments written or read with a single syscall.
+#define SPILL_BUFFER_SEGMENTS 4096
+
+struct spill_run {
+    off_t offset;
+    size_t count;
+};
+
+// Run being merged, or the segments still in memory.
+struct merge_source {
+    off_t offset;  // Of the next record to read into |buf|.
+    size_t left;   // Records not read into |buf| yet.
+    struct plan_segment *buf;
+    size_t buf_len;
+    size_t buf_idx;
+    struct plan_segment head;
+};
+
+struct segment_plan_reader {
+    struct segment_plan *plan;
+    size_t mem_idx;
+    struct merge_source *sources;  // Runs, then memory.
+    size_t source_count;
+    size_t *heap;  // Indices of sources that still have segments.
+    size_t heap_len;
+};
+
+void
+segment_plan_init(struct segment_plan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->spill_fd = -1;
+}
+
+void
+segment_plan_free(struct segment_plan *plan)
+{
+    for (size_t k = 0; k < plan->file_count; k++)
+        fd_pool_unref(plan->files[k]);
+
+    free(plan->physical_pos);
+    free(plan->file_offset);
+    free(plan->extent_length);
+    free(plan->file_idx);
+    free(plan->files);
+    free(plan->runs);
+    if (plan->spill_fd >= 0)
+        close(plan->spill_fd);
+    segment_plan_init(plan);
+}
+
+void
+segment_plan_limit_memory(struct segment_plan *plan, size_t bytes)
+{
+    plan->spill_threshold = bytes / SEGMENT_BYTES;
+    if (bytes > 0 && plan->spill_threshold == 0)
+        plan->spill_threshold = 1;
+}
+
+size_t
+segment_plan_memory_limit(void)
+{
+    size_t limit_mib = DEFAULT_PLAN_MEMORY_MIB;
+
+    const char *env_PRECACHE_PLAN_MEMORY = getenv("PRECACHE_PLAN_MEMORY");
+    if (env_PRECACHE_PLAN_MEMORY)
+        limit_mib = atoi(env_PRECACHE_PLAN_MEMORY);
+
+    return limit_mib * 1024 * 1024;
+}
+
+// Takes over the reference the caller holds.
+static uint32_t
+push_file(struct segment_plan *plan, struct pooled_file *file)
+{
+    if (plan->file_count == plan->files_capacity) {
+        plan->files_capacity =
+            plan->files_capacity ? plan->files_capacity * 2 : 64;
+        plan->files = xrealloc(plan->files,
+                               plan->files_capacity * sizeof(plan->files[0]));
+    }
+
+    plan->files[plan->file_count] = file;
+    return plan->file_count++;
+}
+
+uint32_t
+segment_plan_add_file(struct segment_plan *plan, struct pooled_file *file)
+{
+    return push_file(plan, fd_pool_ref(file));
+}
+
+static int
+create_spill_file(void)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    UT_string path;
+
+    utstring_init(&path);
+    utstring_printf(&path, "%s/precache-plan-XXXXXX", tmpdir ? tmpdir : "/tmp");
+    int fd = mkstemp(utstring_body(&path));
+    if (fd >= 0)
+        unlink(utstring_body(&path));
+    utstring_done(&path);
+
+    return fd;
+}
+
+static bool
+pwrite_all(int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *ptr = buf;
+
+    while (len > 0) {
+        ssize_t written = pwrite(fd, ptr, len, offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        ptr += written;
+        len -= written;
+        offset += written;
+    }
+
+    return true;
+}
+
+static bool
+pread_all(int fd, void *buf, size_t len, off_t offset)
+{
+    char *ptr = buf;
+
+    while (len > 0) {
+        ssize_t bytes_read = pread(fd, ptr, len, offset);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            return false;
+        ptr += bytes_read;
+        len -= bytes_read;
+        offset += bytes_read;
+    }
+
+    return true;
+}
+
+// Sorts segments in memory and moves them into a new run. If that fails,
+// spilling is disabled, and segments stay in memory.
+static void
+spill_segments(struct segment_plan *plan)
+{
+    struct plan_segment *buf = NULL;
+
+    if (plan->spill_fd < 0) {
+        plan->spill_fd = create_spill_file();
+        if (plan->spill_fd < 0)
+            goto err;
+    }
+
+    segment_plan_sort(plan);
+
+    buf = xcalloc(SPILL_BUFFER_SEGMENTS, sizeof(*buf));
+    off_t offset = plan->spill_size;
+    for (size_t k = 0; k < plan->count; k += SPILL_BUFFER_SEGMENTS) {
+        size_t n = plan->count - k;
+        if (n > SPILL_BUFFER_SEGMENTS)
+            n = SPILL_BUFFER_SEGMENTS;
+
+        for (size_t j = 0; j < n; j++) {
+            buf[j].physical_pos = plan->physical_pos[k + j];
+            buf[j].file_offset = plan->file_offset[k + j];
+            buf[j].extent_length = plan->extent_length[k + j];
+            buf[j].file_idx = plan->file_idx[k + j];
+        }
+
+        if (!pwrite_all(plan->spill_fd, buf, n * sizeof(*buf), offset))
+            goto err;
+        offset += n * sizeof(*buf);
+    }
+    free(buf);
+
+    plan->runs =
+        xrealloc(plan->runs, (plan->run_count + 1) * sizeof(plan->runs[0]));
+    plan->runs[plan->run_count].offset = plan->spill_size;
+    plan->runs[plan->run_count].count = plan->count;
+    plan->run_count += 1;
+    plan->spill_size = offset;
+    plan->count = 0;
+    return;
+
+err:
+    fprintf(stderr, "Warning: can't spill segments to a temporary file (%s)\n",
+            strerror(errno));
+    free(buf);
+    plan->spill_threshold = 0;
+}
 
 void
-enumerate_file_segments(const char *fname, struct segment **segments,
+segment_plan_append(struct segment_plan *plan, uint32_t file_idx,
+                    uint64_t physical_pos, uint64_t file_offset,
+                    uint64_t extent_length)
+{
+    if (plan->spill_threshold > 0 && plan->count >= plan->spill_threshold)
+        spill_segments(plan);
+
+    if (plan->count == plan->capacity) {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 1024;
+        if (plan->spill_threshold > 0 &&
+            plan->capacity > plan->spill_threshold)  //
+        {
+            // Arrays never grow past the threshold.
+            plan->capacity = plan->spill_threshold;
+        }
+        plan->physical_pos = xrealloc(plan->physical_pos,
+                                      plan->capacity * sizeof(uint64_t));
+        plan->file_offset =
+            xrealloc(plan->file_offset, plan->capacity * sizeof(uint64_t));
+        plan->extent_length =
+            xrealloc(plan->extent_length, plan->capacity * sizeof(uint64_t));
+        plan->file_idx =
+            xrealloc(plan->file_idx, plan->capacity * sizeof(uint32_t));
+    }
+
+    size_t k = plan->count++;
+    plan->physical_pos[k] = physical_pos;
+    plan->file_offset[k] = file_offset;
+    plan->extent_length[k] = extent_length;
+    plan->file_idx[k] = file_idx;
+}
+
+void
+segment_plan_move(struct segment_plan *dst, struct segment_plan *src)
+{
+    uint32_t first_file_idx = dst->file_count;
+
+    for (size_t k = 0; k < src->file_count; k++)
+        push_file(dst, src->files[k]);
+
+    for (size_t k = 0; k < src->count; k++) {
+        segment_plan_append(dst, first_file_idx + src->file_idx[k],
+                            src->physical_pos[k], src->file_offset[k],
+                            src->extent_length[k]);
+    }
+
+    src->file_count = 0;
+    src->count = 0;
+}
+
+size_t
+segment_plan_size(const struct segment_plan *plan)
+{
+    size_t count = plan->count;
+
+    for (size_t k = 0; k < plan->run_count; k++)
+        count += plan->runs[k].count;
+    return count;
+}
+
+static uint64_t *
+permute_u64(uint64_t *values, const uint32_t *order, size_t count)
+{
+    uint64_t *permuted = xmalloc(count * sizeof(*permuted));
+
+    for (size_t k = 0; k < count; k++)
+        permuted[k] = values[order[k]];
+    free(values);
+    return permuted;
+}
+
+void
+segment_plan_sort(struct segment_plan *plan)
+{
+    size_t n = plan->count;
+    if (n < 2)
+        return;
+
+    // LSD radix sort, one byte per pass. Keys move along with indices, so
+    // each pass reads memory sequentially. Passes where all keys have the
+    // same byte are skipped; that's usually the case for high bytes.
+    uint64_t *keys = plan->physical_pos;
+    uint64_t *keys_tmp = xmalloc(n * sizeof(*keys_tmp));
+    uint32_t *order = xmalloc(n * sizeof(*order));
+    uint32_t *order_tmp = xmalloc(n * sizeof(*order_tmp));
+    size_t(*counts)[256] = xcalloc(8, sizeof(*counts));
+
+    for (size_t k = 0; k < n; k++) {
+        order[k] = k;
+        for (unsigned byte = 0; byte < 8; byte++)
+            counts[byte][(keys[k] >> (byte * 8)) & 0xff] += 1;
+    }
+
+    for (unsigned byte = 0; byte < 8; byte++) {
+        unsigned shift = byte * 8;
+        size_t *offsets = counts[byte];
+
+        if (offsets[(keys[0] >> shift) & 0xff] == n)
+            continue;
+
+        size_t sum = 0;
+        for (unsigned digit = 0; digit < 256; digit++) {
+            size_t digit_count = offsets[digit];
+            offsets[digit] = sum;
+            sum += digit_count;
+        }
+
+        for (size_t k = 0; k < n; k++) {
+            size_t dst = offsets[(keys[k] >> shift) & 0xff]++;
+            keys_tmp[dst] = keys[k];
+            order_tmp[dst] = order[k];
+        }
+
+        uint64_t *keys_swap = keys;
+        keys = keys_tmp;
+        keys_tmp = keys_swap;
+        uint32_t *order_swap = order;
+        order = order_tmp;
+        order_tmp = order_swap;
+    }
+
+    free(counts);
+    free(order_tmp);
+
+    // Sorted keys are in one of the two buffers, the other one goes.
+    plan->physical_pos = keys;
+    free(keys_tmp);
+
+    plan->file_offset = permute_u64(plan->file_offset, order, n);
+    plan->extent_length = permute_u64(plan->extent_length, order, n);
+
+    uint32_t *file_idx = xmalloc(n * sizeof(*file_idx));
+    for (size_t k = 0; k < n; k++)
+        file_idx[k] = plan->file_idx[order[k]];
+    free(plan->file_idx);
+    plan->file_idx = file_idx;
+
+    free(order);
+}
+
+// Moves the next segment of source |idx| into its |head|. Returns false if
+// there are no more.
+static bool
+advance_source(struct segment_plan_reader *reader, size_t idx)
+{
+    struct segment_plan *plan = reader->plan;
+    struct merge_source *src = &reader->sources[idx];
+
+    if (idx == plan->run_count) {
+        // Segments still in memory, already sorted.
+        size_t k = reader->mem_idx;
+        if (k >= plan->count)
+            return false;
+
+        src->head.physical_pos = plan->physical_pos[k];
+        src->head.file_offset = plan->file_offset[k];
+        src->head.extent_length = plan->extent_length[k];
+        src->head.file_idx = plan->file_idx[k];
+        reader->mem_idx += 1;
+        return true;
+    }
+
+    if (src->buf_idx == src->buf_len) {
+        size_t n = src->left;
+        if (n > SPILL_BUFFER_SEGMENTS)
+            n = SPILL_BUFFER_SEGMENTS;
+        if (n == 0)
+            return false;
+
+        // Later reads are never larger than the first one.
+        if (!src->buf)
+            src->buf = xmalloc(n * sizeof(src->buf[0]));
+
+        if (!pread_all(plan->spill_fd, src->buf, n * sizeof(src->buf[0]),
+                       src->offset))  //
+        {
+            fprintf(stderr, "Warning: can't read spilled segments\n");
+            src->left = 0;
+            return false;
+        }
+
+        src->offset += n * sizeof(src->buf[0]);
+        src->left -= n;
+        src->buf_len = n;
+        src->buf_idx = 0;
+    }
+
+    src->head = src->buf[src->buf_idx++];
+    return true;
+}
+
+// Earlier sources go first among equal positions, so the merge is stable.
+static bool
+source_less(struct segment_plan_reader *reader, size_t a, size_t b)
+{
+    uint64_t pos_a = reader->sources[a].head.physical_pos;
+    uint64_t pos_b = reader->sources[b].head.physical_pos;
+
+    return pos_a < pos_b || (pos_a == pos_b && a < b);
+}
+
+static void
+sift_down(struct segment_plan_reader *reader, size_t k)
+{
+    size_t *heap = reader->heap;
+
+    while (1) {
+        size_t smallest = k;
+        size_t left = 2 * k + 1;
+        size_t right = 2 * k + 2;
+
+        if (left < reader->heap_len &&
+            source_less(reader, heap[left], heap[smallest]))
+            smallest = left;
+        if (right < reader->heap_len &&
+            source_less(reader, heap[right], heap[smallest]))
+            smallest = right;
+        if (smallest == k)
+            break;
+
+        size_t tmp = heap[k];
+        heap[k] = heap[smallest];
+        heap[smallest] = tmp;
+        k = smallest;
+    }
+}
+
+struct segment_plan_reader *
+segment_plan_reader_new(struct segment_plan *plan)
+{
+    struct segment_plan_reader *reader = xcalloc(1, sizeof(*reader));
+
+    segment_plan_sort(plan);
+
+    reader->plan = plan;
+    reader->source_count = plan->run_count + 1;
+    reader->sources =
+        xcalloc(reader->source_count, sizeof(reader->sources[0]));
+    reader->heap = xmalloc(reader->source_count * sizeof(reader->heap[0]));
+
+    for (size_t k = 0; k < plan->run_count; k++) {
+        reader->sources[k].offset = plan->runs[k].offset;
+        reader->sources[k].left = plan->runs[k].count;
+    }
+
+    for (size_t k = 0; k < reader->source_count; k++) {
+        if (advance_source(reader, k))
+            reader->heap[reader->heap_len++] = k;
+    }
+
+    for (size_t k = reader->heap_len / 2; k > 0; k--)
+        sift_down(reader, k - 1);
+
+    return reader;
+}
+
+bool
+segment_plan_reader_next(struct segment_plan_reader *reader,
+                         struct plan_segment *seg)
+{
+    if (reader->heap_len == 0)
+        return false;
+
+    size_t idx = reader->heap[0];
+    *seg = reader->sources[idx].head;
+
+    if (!advance_source(reader, idx))
+        reader->heap[0] = reader->heap[--reader->heap_len];
+    sift_down(reader, 0);
+
+    return true;
+}
+
+void
+segment_plan_reader_free(struct segment_plan_reader *reader)
+{
+    if (!reader)
+        return;
+
+    for (size_t k = 0; k < reader->source_count; k++)
+        free(reader->sources[k].buf);
+    free(reader->sources);
+    free(reader->heap);
+    free(reader);
+}
+
+void
+enumerate_file_segments(struct fd_pool *pool, struct extent_cache *cache,
+                        const char *fname, struct segment_plan *plan,
                         size_t *file_segment_count)
 {
     uint32_t extent_buffer_elements = 1000;
     struct fiemap *fiemap = NULL;
+    struct cached_extent *found = NULL;
+    size_t found_count = 0;
+    size_t found_capacity = 0;
 
     if (file_segment_count)
         *file_segment_count = 0;
@@ -30,17 +526,34 @@ enumerate_file_segments(const char *fname, struct segment **segments,
     if (!resolved_path)
         goto err_1;
 
-    int fd = open(resolved_path, O_RDONLY);
+    struct pooled_file *file = fd_pool_get(pool, resolved_path);
+    int fd = fd_pool_pin(file);
     if (fd < 0)
         goto err_2;
 
     struct stat sb;
     int res = fstat(fd, &sb);
     if (res != 0)
-        goto err_3;
+        goto done;
+
+    uint32_t file_idx = segment_plan_add_file(plan, file);
+
+    const struct cached_extent *cached;
+    size_t cached_count;
+    if (extent_cache_lookup(cache, &sb, &cached, &cached_count)) {
+        for (size_t k = 0; k < cached_count; k++) {
+            segment_plan_append(plan, file_idx, cached[k].physical_pos,
+                                cached[k].file_offset,
+                                cached[k].extent_length);
+        }
+        if (file_segment_count)
+            *file_segment_count = cached_count;
+        goto done;
+    }
 
     uint64_t pos = 0;
     bool last_extent_seen = false;
+    bool cacheable = cache != NULL;
 
     while (pos < (uint64_t)sb.st_size && !last_extent_seen) {
         memset(fiemap, 0, sizeof(struct fiemap));
@@ -50,8 +563,10 @@ enumerate_file_segments(const char *fname, struct segment **segments,
         fiemap->fm_extent_count = extent_buffer_elements;
 
         int ioctl_res = ioctl(fd, FS_IOC_FIEMAP, fiemap);
-        if (ioctl_res != 0)
+        if (ioctl_res != 0) {
+            cacheable = false;
             break;
+        }
 
         if (fiemap->fm_mapped_extents == 0) {
             // Some files don't have any extents.
@@ -71,36 +586,40 @@ enumerate_file_segments(const char *fname, struct segment **segments,
                     ext->fe_length = sb.st_size - ext->fe_logical;
             }
 
-            struct segment *seg = xmalloc(sizeof(*seg));
+            segment_plan_append(plan, file_idx, ext->fe_physical,
+                                ext->fe_logical, ext->fe_length);
 
-            seg->file_name = xstrdup(resolved_path);
-            seg->physical_pos = ext->fe_physical;
-            seg->file_offset = ext->fe_logical;
-            seg->extent_length = ext->fe_length;
+            // Delayed allocation ends without changing mtime or ctime.
+            if (ext->fe_flags &
+                (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC))
+                cacheable = false;
 
-            DL_APPEND(*segments, seg);
+            if (cacheable) {
+                if (found_count == found_capacity) {
+                    found_capacity = found_capacity ? found_capacity * 2 : 16;
+                    found = xrealloc(found, found_capacity * sizeof(*found));
+                }
+                found[found_count].physical_pos = ext->fe_physical;
+                found[found_count].file_offset = ext->fe_logical;
+                found[found_count].extent_length = ext->fe_length;
+                found_count += 1;
+            }
         }
 
         if (file_segment_count)
             *file_segment_count += fiemap->fm_mapped_extents;
     }
 
-err_3:
-    close(fd);
+    if (cacheable)
+        extent_cache_store(cache, &sb, found, found_count);
+
+done:
+    fd_pool_unpin(file);
 err_2:
+    fd_pool_unref(file);
     free(resolved_path);
 err_1:
+    free(found);
     free(fiemap);
     return;
 }
-
-void
-free_segment_list(struct segment **segments)
-{
-    while (*segments) {
-        struct segment *it = *segments;
-        DL_DELETE(*segments, it);
-        free(it->file_name);
-        free(it);
-    }
-}
@@ -3,31 +3,114 @@
 
 #pragma once
 
+#include "extent_cache.h"
+#include "fd_pool.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
-struct segment {
-    char *file_name;
+struct spill_run;
+struct segment_plan_reader;
+
+// Segments to read, as parallel arrays. Mapping a whole filesystem produces
+// tens of millions of extents, and this takes 28 bytes per extent, while
+// sorting fast. Files are interned in |files|, and segments refer to them by
+// index.
+struct segment_plan {
+    uint64_t *physical_pos;
+    uint64_t *file_offset;
+    uint64_t *extent_length;
+    uint32_t *file_idx;
+    size_t count;
+    size_t capacity;
+
+    struct pooled_file **files;  // Each holds a reference.
+    size_t file_count;
+    size_t files_capacity;
+
+    // Once there are this many segments in memory, they are sorted and
+    // spilled to |spill_fd| as a run. Zero disables spilling. Only segments
+    // are spilled, |files| stays in memory.
+    size_t spill_threshold;
+    int spill_fd;
+    off_t spill_size;
+    struct spill_run *runs;
+    size_t run_count;
+};
+
+// Segment as stored in spilled runs, and as returned by plan readers.
+struct plan_segment {
     uint64_t physical_pos;
     uint64_t file_offset;
     uint64_t extent_length;
-    struct segment *prev, *next;
+    uint32_t file_idx;
 };
 
-static inline int
-segment_comparator(const void *a, const void *b)
-{
-    const struct segment *a_ = a;
-    const struct segment *b_ = b;
+void
+segment_plan_init(struct segment_plan *plan);
 
-    return (a_->physical_pos < b_->physical_pos)
-               ? -1
-               : (a_->physical_pos > b_->physical_pos);
-}
+// Releases the arrays, the files, and spilled runs. Plan can be used again
+// after segment_plan_init().
+void
+segment_plan_free(struct segment_plan *plan);
 
+// Limits memory taken by segments to about |bytes|. Segments over that are
+// kept in a temporary file, in $TMPDIR or /tmp. Zero means no limit. The file
+// table is not covered, and stays in memory, as files are opened by their
+// paths when read. It takes about a hundred bytes per file, plus the path,
+// while there are usually several segments per file.
 void
-enumerate_file_segments(const char *fname, struct segment **segments,
-                        size_t *file_segment_count);
+segment_plan_limit_memory(struct segment_plan *plan, size_t bytes);
+
+// Returns the limit for segments in bytes, as set by PRECACHE_PLAN_MEMORY, in
+// MiB.
+size_t
+segment_plan_memory_limit(void);
+
+// Adds |file| to the file table, and returns its index. Plan takes its own
+// reference.
+uint32_t
+segment_plan_add_file(struct segment_plan *plan, struct pooled_file *file);
+
+void
+segment_plan_append(struct segment_plan *plan, uint32_t file_idx,
+                    uint64_t physical_pos, uint64_t file_offset,
+                    uint64_t extent_length);
+
+// Moves all files and segments of |src| into |dst|. |src| is left empty, but
+// keeps its arrays for reuse. |src| must not have spilled runs.
+void
+segment_plan_move(struct segment_plan *dst, struct segment_plan *src);
 
+// Returns the number of segments, including spilled ones.
+size_t
+segment_plan_size(const struct segment_plan *plan);
+
+// Sorts segments by physical_pos. Segments with equal positions stay in the
+// order they were added. Only segments in memory are sorted.
 void
-free_segment_list(struct segment **segments);
+segment_plan_sort(struct segment_plan *plan);
+
+// Returns all segments of |plan|, including spilled ones, in physical_pos
+// order. Spilled runs are merged as they are read, so memory use doesn't
+// depend on the plan size. Plan must not be changed until the reader is
+// freed.
+struct segment_plan_reader *
+segment_plan_reader_new(struct segment_plan *plan);
+
+// Fills |seg| with the next segment. Returns false when there are no more.
+bool
+segment_plan_reader_next(struct segment_plan_reader *reader,
+                         struct plan_segment *seg);
+
+void
+segment_plan_reader_free(struct segment_plan_reader *reader);
+
+// Appends segments of |fname| to |plan|. File is opened through |pool|, and
+// stays there for reading. Extents are taken from |cache| if it has them, and
+// are stored there otherwise. |cache| may be NULL.
+void
+enumerate_file_segments(struct fd_pool *pool, struct extent_cache *cache,
+                        const char *fname, struct segment_plan *plan,
+                        size_t *file_segment_count);
@@ -2,9 +2,11 @@
 // SPDX-License-Identifier: MIT
 
 #include "intercepted_functions.h"
+#include "mem.h"
 #include "utils.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <unistd.h>
 
 int
@@ -43,3 +45,30 @@ err_2:
 err_1:
     return -1;
 }
+
+char *
+get_fd_path(int fd)
+{
+    char link_name[64];
+    size_t buf_size = 256;
+
+    snprintf(link_name, sizeof(link_name), "/proc/self/fd/%d", fd);
+
+    while (1) {
+        char *buf = xmalloc(buf_size);
+        ssize_t len = readlink(link_name, buf, buf_size);
+        if (len < 0) {
+            free(buf);
+            return NULL;
+        }
+
+        if ((size_t)len < buf_size) {
+            buf[len] = '\0';
+            return buf;
+        }
+
+        // Possibly truncated.
+        free(buf);
+        buf_size *= 2;
+    }
+}
@@ -7,3 +7,8 @@
 
 int
 file_get_contents(const char *file_name, UT_string *body);
+
+// Returns path of the file opened as |fd|, or NULL on failure. Caller should
+// free() the result.
+char *
+get_fd_path(int fd);
@@ -0,0 +1,1107 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include "worker.h"
+#include "encfs_mapper.h"
+#include "fd_pool.h"
+#include "intercepted_functions.h"
+#include "io_queue.h"
+#include "log.h"
+#include "mem.h"
+#include "order.h"
+#include "read_engine.h"
+#include "segments.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uthash.h>
+#include <utlist.h>
+#include <utstring.h>
+
+// Files have two positions. |idx| is the index of the entry in the stream's
+// snapshot the file is under: the file itself, or the top-level subdirectory
+// it's in. |seq| is the order in which files were mapped, which is depth-first
+// for recursive streams. Consumer passes a file when it gets past either.
+struct window_file {
+    UT_hash_handle hh;
+    size_t idx;
+    size_t seq;
+    uint64_t size;
+    char *path;  // Relative to the stream directory. Recursive streams only.
+    struct window_file *prev, *next;
+};
+
+// File the consumer of a recursive stream opened before the worker got to it.
+// Once the worker gets there, files mapped before it are passed.
+struct pending_path {
+    UT_hash_handle hh;
+    char *path;
+    struct pending_path *prev, *next;
+};
+
+// Consumer may open files the worker never gets to, so only the latest few
+// are remembered.
+#define MAX_PENDING_PATHS 64
+
+// Directory being enumerated by the worker. Recursive streams have a stack of
+// these, the first one is the stream directory itself.
+struct subtree_level {
+    struct dir_snapshot *snapshot;
+    char *prefix;  // Path relative to the stream directory, with a slash.
+    size_t next_idx;
+    struct subtree_level *prev, *next;
+};
+
+struct precache_stream {
+    int refcount;
+    struct dir_snapshot *snapshot;
+    size_t window_bytes;
+    size_t window_files;
+    bool call_sync;
+    bool recursive;
+
+    // Set by the consumer.
+    size_t cursor_idx;
+    size_t cursor_seq;
+    bool closed;
+    struct pending_path *pending;  // In the order of opens.
+    struct pending_path *pending_by_path;
+    size_t pending_count;
+
+    // Maintained by the worker.
+    struct subtree_level *levels;
+    size_t next_seq;
+    bool exhausted;  // All entries of the snapshot were mapped.
+    struct window_file *window;  // Mapped files at or after the cursor.
+    struct window_file *window_by_path;
+    size_t files_ahead;
+    uint64_t bytes_ahead;
+    uint64_t bytes_wanted;  // Size of the next file, if it didn't fit.
+
+    struct precache_stream *prev, *next;
+};
+
+struct stat_prefetch {
+    int refcount;
+    struct dir_snapshot *snapshot;
+    bool closed;
+    struct stat_prefetch *prev, *next;
+};
+
+struct order_inference {
+    struct dir_snapshot *snapshot;
+    char *sample[ORDER_SAMPLE_SIZE];
+    size_t sample_len;
+    order_inference_done_t done;
+    void *arg;
+    struct order_inference *prev, *next;
+};
+
+struct inode_entry {
+    ino_t ino;
+    const char *name;
+};
+
+// Entry a file in a segment plan was mapped for.
+struct segment_owner {
+    size_t entry_idx;
+    size_t seq;
+};
+
+struct queued_segment {
+    struct precache_stream *stream;
+    size_t entry_idx;
+    size_t seq;
+    struct pooled_file *file;
+    uint64_t physical_pos;
+    uint64_t file_offset;
+    uint64_t extent_length;
+    struct queued_segment *prev, *next;
+};
+
+// Everything below is protected by |worker_mutex|.
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t worker_atfork_once = PTHREAD_ONCE_INIT;
+static struct precache_stream *streams = NULL;
+static struct stat_prefetch *stat_prefetches = NULL;
+static struct order_inference *order_inferences = NULL;
+static struct queued_segment *read_queue = NULL;  // Sorted by physical_pos.
+static uint64_t elevator_pos = 0;
+static bool worker_started = false;
+static struct fd_pool *fd_pool = NULL;
+static struct extent_cache *extent_cache = NULL;  // Only read here.
+
+static void
+free_queued_segment(struct queued_segment *seg)
+{
+    fd_pool_unref(seg->file);
+    free(seg);
+}
+
+static void
+free_segment_queue(struct queued_segment **queue)
+{
+    while (*queue) {
+        struct queued_segment *seg = *queue;
+        DL_DELETE(*queue, seg);
+        free_queued_segment(seg);
+    }
+}
+
+static void
+free_window_file(struct window_file *wf)
+{
+    free(wf->path);
+    free(wf);
+}
+
+static void
+push_subtree_level(struct precache_stream *stream,
+                   struct dir_snapshot *snapshot, const char *prefix)
+{
+    struct subtree_level *level = xcalloc(1, sizeof(*level));
+
+    level->snapshot = snapshot;
+    level->prefix = xstrdup(prefix);
+    DL_APPEND(stream->levels, level);
+}
+
+static void
+pop_subtree_level(struct precache_stream *stream)
+{
+    struct subtree_level *level = stream->levels->prev;
+
+    DL_DELETE(stream->levels, level);
+    dir_snapshot_unref(level->snapshot);
+    free(level->prefix);
+    free(level);
+}
+
+static void
+forget_pending_path(struct precache_stream *stream, struct pending_path *pp)
+{
+    DL_DELETE(stream->pending, pp);
+    HASH_DEL(stream->pending_by_path, pp);
+    __atomic_sub_fetch(&stream->pending_count, 1, __ATOMIC_RELAXED);
+    free(pp->path);
+    free(pp);
+}
+
+// Worker is about to map |path| as file |seq|. If the consumer has opened it
+// already, it's passed along with files before it, and true is returned.
+// Called without |worker_mutex| held.
+static bool
+consumer_reached_path(struct precache_stream *stream, const char *path,
+                      size_t seq)
+{
+    struct pending_path *pp;
+    bool reached = false;
+
+    if (__atomic_load_n(&stream->pending_count, __ATOMIC_RELAXED) == 0)
+        return false;
+
+    pthread_mutex_lock(&worker_mutex);
+    HASH_FIND_STR(stream->pending_by_path, path, pp);
+    if (pp) {
+        // Files opened before this one are left behind too.
+        while (stream->pending != pp)
+            forget_pending_path(stream, stream->pending);
+        forget_pending_path(stream, pp);
+
+        if (seq > stream->cursor_seq)
+            stream->cursor_seq = seq;
+        reached = true;
+    }
+    pthread_mutex_unlock(&worker_mutex);
+
+    return reached;
+}
+
+static void
+unref_stream(struct precache_stream *stream)
+{
+    if (--stream->refcount > 0)
+        return;
+
+    while (stream->pending)
+        forget_pending_path(stream, stream->pending);
+
+    HASH_CLEAR(hh, stream->window_by_path);
+    while (stream->window) {
+        struct window_file *wf = stream->window;
+        DL_DELETE(stream->window, wf);
+        free_window_file(wf);
+    }
+
+    while (stream->levels)
+        pop_subtree_level(stream);
+
+    dir_snapshot_unref(stream->snapshot);
+    free(stream);
+}
+
+// Index of the top-level entry being mapped.
+static size_t
+mapping_idx(const struct precache_stream *stream)
+{
+    const struct subtree_level *top = stream->levels;
+
+    // Index of a subdirectory is incremented before descending into it.
+    return top->prev == top ? top->next_idx : top->next_idx - 1;
+}
+
+static bool
+consumer_passed(const struct precache_stream *stream, size_t idx, size_t seq)
+{
+    return idx < stream->cursor_idx || seq < stream->cursor_seq;
+}
+
+// Drops files the consumer has already passed from the window.
+static void
+trim_window(struct precache_stream *stream)
+{
+    while (stream->window &&
+           consumer_passed(stream, stream->window->idx, stream->window->seq))
+    {
+        struct window_file *wf = stream->window;
+
+        stream->files_ahead -= 1;
+        stream->bytes_ahead -= wf->size;
+        DL_DELETE(stream->window, wf);
+        if (wf->path)
+            HASH_DEL(stream->window_by_path, wf);
+        free_window_file(wf);
+    }
+
+    // Consumer may outrun the worker. There is no point in mapping files that
+    // are already being read.
+    if (mapping_idx(stream) < stream->cursor_idx) {
+        while (stream->levels->prev != stream->levels)
+            pop_subtree_level(stream);
+        stream->levels->next_idx = stream->cursor_idx;
+        stream->bytes_wanted = 0;
+    }
+}
+
+static size_t
+increment_size(const struct precache_stream *stream)
+{
+    size_t increment = stream->window_files / 16;
+    return increment > 0 ? increment : 1;
+}
+
+static bool
+stream_wants_mapping(struct precache_stream *stream)
+{
+    if (stream->closed || stream->exhausted)
+        return false;
+
+    trim_window(stream);
+
+    // Refill in increments, to let the elevator sort a reasonable number of
+    // segments at once. A file that didn't fit waits until there is room.
+    uint64_t bytes_increment = stream->window_bytes / 16;
+    if (stream->bytes_wanted > bytes_increment)
+        bytes_increment = stream->bytes_wanted;
+
+    return stream->files_ahead + increment_size(stream) <=
+               stream->window_files &&
+           stream->bytes_ahead + bytes_increment <= stream->window_bytes;
+}
+
+// Inserts sorted |segments| into the sorted read queue.
+static void
+merge_into_read_queue(struct queued_segment *segments)
+{
+    struct queued_segment *pos = read_queue;
+
+    while (segments) {
+        struct queued_segment *seg = segments;
+        DL_DELETE(segments, seg);
+
+        while (pos && pos->physical_pos <= seg->physical_pos)
+            pos = pos->next;
+
+        if (pos == NULL) {
+            DL_APPEND(read_queue, seg);
+        } else if (pos == read_queue) {
+            DL_PREPEND(read_queue, seg);
+        } else {
+            seg->prev = pos->prev;
+            seg->next = pos;
+            pos->prev->next = seg;
+            pos->prev = seg;
+        }
+    }
+}
+
+static void
+drop_stream_segments(struct precache_stream *stream)
+{
+    struct queued_segment *seg, *tmp;
+
+    DL_FOREACH_SAFE (read_queue, seg, tmp) {
+        if (seg->stream == stream) {
+            DL_DELETE(read_queue, seg);
+            free_queued_segment(seg);
+        }
+    }
+}
+
+// Maps a single file into |plan|, and records its entry in |owners|, at the
+// index the file got in the plan. Returns its size, or 0 if the file can't be
+// or shouldn't be precached. If the file fits into the window, but not into
+// the |room| left in it, returns 0 and sets |*wanted| to the file size.
+static uint64_t
+map_file(struct precache_stream *stream, size_t entry_idx, size_t seq,
+         const char *d_name, uint64_t room, struct segment_plan *plan,
+         struct segment_owner *owners, uint64_t *wanted)
+{
+    uint32_t extent_buffer_elements = 1000;
+    struct fiemap *fiemap = NULL;
+    UT_string fname;
+    uint64_t file_size = 0;
+
+    utstring_init(&fname);
+    utstring_printf(&fname, "%s/%s", stream->snapshot->dirname, d_name);
+    char *resolved_path = encfs_mapper_resolve_path(utstring_body(&fname));
+    LOG("%s: path=%s", __func__, utstring_body(&fname));
+    LOG("%s: resolved-path=%s", __func__, resolved_path);
+    if (!resolved_path)
+        goto err_1;
+
+    struct pooled_file *file = fd_pool_get(fd_pool, resolved_path);
+    int fd = fd_pool_pin(file);
+    if (fd < 0)
+        goto err_2;
+
+    if (stream->call_sync) {
+        syncfs(fd);
+        stream->call_sync = false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+        goto done;
+
+    if ((uint64_t)sb.st_size > stream->window_bytes) {
+        // Doesn't fit into the window, even if the window is empty.
+        goto done;
+    }
+
+    if ((uint64_t)sb.st_size > room) {
+        // Will fit once the consumer moves on.
+        *wanted = sb.st_size;
+        goto done;
+    }
+
+    file_size = sb.st_size;
+
+    uint32_t file_idx = segment_plan_add_file(plan, file);
+    owners[file_idx].entry_idx = entry_idx;
+    owners[file_idx].seq = seq;
+
+    const struct cached_extent *cached;
+    size_t cached_count;
+    if (extent_cache_lookup(extent_cache, &sb, &cached, &cached_count)) {
+        LOG("%s: %zu extents from cache", __func__, cached_count);
+        for (size_t k = 0; k < cached_count; k++) {
+            segment_plan_append(plan, file_idx, cached[k].physical_pos,
+                                cached[k].file_offset,
+                                cached[k].extent_length);
+        }
+        goto done;
+    }
+
+    // Valgrind currently doesn't know about FIEMAP ioctls.
+    fiemap = xcalloc(1, sizeof(struct fiemap) + sizeof(struct fiemap_extent) *
+                                                    extent_buffer_elements);
+
+    uint64_t pos = 0;
+    bool last_extent_seen = false;
+    while (pos < (uint64_t)sb.st_size && !last_extent_seen) {
+        memset(fiemap, 0, sizeof(struct fiemap));
+        fiemap->fm_start = pos;
+        fiemap->fm_length = UINT64_MAX;
+        fiemap->fm_flags = 0;
+        fiemap->fm_extent_count = extent_buffer_elements;
+
+        int ioctl_res = ioctl(fd, FS_IOC_FIEMAP, fiemap);
+        if (ioctl_res != 0)
+            break;
+
+        if (fiemap->fm_mapped_extents == 0) {
+            // Some files don't have any extents.
+            break;
+        }
+
+        for (uint32_t idx = 0; idx < fiemap->fm_mapped_extents; idx++) {
+            struct fiemap_extent *ext = &fiemap->fm_extents[idx];
+
+            pos = ext->fe_logical + ext->fe_length;
+            if (ext->fe_flags & FIEMAP_EXTENT_LAST)
+                last_extent_seen = true;
+
+            if (ext->fe_logical <= (uint64_t)sb.st_size) {
+                // Reduce .fe_length to match file size.
+                if (ext->fe_logical + ext->fe_length > (uint64_t)sb.st_size)
+                    ext->fe_length = sb.st_size - ext->fe_logical;
+            }
+
+            segment_plan_append(plan, file_idx, ext->fe_physical,
+                                ext->fe_logical, ext->fe_length);
+            LOG("%s: segment (%8zu, %7zu) path=%s", __func__,
+                (size_t)ext->fe_physical, (size_t)ext->fe_length,
+                file->path);
+        }
+    }
+
+    free(fiemap);
+done:
+    fd_pool_unpin(file);
+err_2:
+    fd_pool_unref(file);
+    free(resolved_path);
+err_1:
+    utstring_done(&fname);
+    return file_size;
+}
+
+static bool
+is_directory(const char *path, const struct dirent *de)
+{
+    if (de->d_type != DT_UNKNOWN)
+        return de->d_type == DT_DIR;
+
+    struct stat sb;
+    return lstat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+// Reads subdirectory |rel_path| of a recursive stream, so its entries are
+// mapped next.
+static void
+descend(struct precache_stream *stream, const char *path, const char *rel_path)
+{
+    DIR *dirp = real_opendir(path);
+    if (!dirp)
+        return;
+
+    struct dir_snapshot *snapshot = dir_snapshot_new(path, dirp);
+    dir_snapshot_finish(snapshot, true);
+    real_closedir(dirp);
+
+    UT_string prefix;
+    utstring_init(&prefix);
+    utstring_printf(&prefix, "%s/", rel_path);
+    push_subtree_level(stream, snapshot, utstring_body(&prefix));
+    utstring_done(&prefix);
+}
+
+// Maps next few files of the stream and puts their segments into the read
+// queue. Called with |worker_mutex| held, but releases it while doing I/O.
+// Recursive streams descend into subdirectories as they go.
+static void
+map_increment(struct precache_stream *stream)
+{
+    bool exhausted = false;
+    uint64_t wanted = 0;
+    size_t count = increment_size(stream);
+    uint64_t room = stream->window_bytes - stream->bytes_ahead;
+    struct window_file *mapped = NULL;
+    struct queued_segment *segments = NULL;
+    struct segment_plan plan;
+    UT_string rel_path;
+    UT_string path;
+
+    // Each step maps at most one file.
+    struct segment_owner *owners = xmalloc(count * sizeof(*owners));
+
+    segment_plan_init(&plan);
+    utstring_init(&rel_path);
+    utstring_init(&path);
+    pthread_mutex_unlock(&worker_mutex);
+
+    // Consumers don't look for encfs mounts, as most directories they open
+    // are never read ahead.
+    if (stream->next_seq == 0)
+        encfs_mapper_refresh_mounts(stream->snapshot->dirname);
+
+    // Snapshot may still be reading the directory, so it's done without the
+    // mutex too. Levels are only used by the worker.
+    for (; count > 0; count--) {
+        struct subtree_level *level = stream->levels->prev;
+        size_t idx = mapping_idx(stream);
+
+        struct dirent *de =
+            dir_snapshot_entry(level->snapshot, level->next_idx);
+        if (!de && level == stream->levels) {
+            exhausted = true;
+            break;
+        }
+
+        if (!de) {
+            pop_subtree_level(stream);
+            continue;
+        }
+
+        const char *d_name = de->d_name;
+        if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0) {
+            level->next_idx += 1;
+            continue;
+        }
+
+        utstring_clear(&rel_path);
+        utstring_printf(&rel_path, "%s%s", level->prefix, d_name);
+
+        if (stream->recursive) {
+            utstring_clear(&path);
+            utstring_printf(&path, "%s/%s", stream->snapshot->dirname,
+                            utstring_body(&rel_path));
+            if (is_directory(utstring_body(&path), de)) {
+                level->next_idx += 1;
+                descend(stream, utstring_body(&path),
+                        utstring_body(&rel_path));
+                continue;
+            }
+        }
+
+        size_t seq = stream->next_seq;
+        if (stream->recursive &&
+            consumer_reached_path(stream, utstring_body(&rel_path), seq))
+        {
+            // Consumer is reading it already.
+            LOG("%s: consumer is ahead, at %s", __func__,
+                utstring_body(&rel_path));
+            level->next_idx += 1;
+            stream->next_seq += 1;
+            continue;
+        }
+
+        uint64_t size = map_file(stream, idx, seq, utstring_body(&rel_path),
+                                 room, &plan, owners, &wanted);
+        if (wanted > 0) {
+            // Retried when the window has room.
+            break;
+        }
+
+        level->next_idx += 1;
+        stream->next_seq += 1;
+
+        struct window_file *wf = xcalloc(1, sizeof(*wf));
+        wf->idx = idx;
+        wf->seq = seq;
+        wf->size = size;
+        if (stream->recursive)
+            wf->path = xstrdup(utstring_body(&rel_path));
+        DL_APPEND(mapped, wf);
+        room -= size;
+    }
+
+    utstring_done(&rel_path);
+    utstring_done(&path);
+
+    segment_plan_sort(&plan);
+    for (size_t k = 0; k < plan.count; k++) {
+        uint32_t file_idx = plan.file_idx[k];
+        struct queued_segment *seg = xmalloc(sizeof(*seg));
+
+        seg->stream = stream;
+        seg->entry_idx = owners[file_idx].entry_idx;
+        seg->seq = owners[file_idx].seq;
+        seg->file = fd_pool_ref(plan.files[file_idx]);
+        seg->physical_pos = plan.physical_pos[k];
+        seg->file_offset = plan.file_offset[k];
+        seg->extent_length = plan.extent_length[k];
+        DL_APPEND(segments, seg);
+    }
+    segment_plan_free(&plan);
+    free(owners);
+
+    pthread_mutex_lock(&worker_mutex);
+
+    stream->exhausted = exhausted;
+    stream->bytes_wanted = wanted;
+
+    while (mapped) {
+        struct window_file *wf = mapped;
+        DL_DELETE(mapped, wf);
+        if (consumer_passed(stream, wf->idx, wf->seq)) {
+            free_window_file(wf);
+            continue;
+        }
+        stream->files_ahead += 1;
+        stream->bytes_ahead += wf->size;
+        DL_APPEND(stream->window, wf);
+        if (wf->path)
+            HASH_ADD_KEYPTR(hh, stream->window_by_path, wf->path,
+                            strlen(wf->path), wf);
+    }
+
+    if (stream->closed)
+        free_segment_queue(&segments);
+    else
+        merge_into_read_queue(segments);
+}
+
+// Picks the next segment in elevator order: the first one at or after the
+// last read position, wrapping around to the start of the queue.
+static struct queued_segment *
+pick_next_segment(void)
+{
+    while (read_queue) {
+        struct queued_segment *seg = read_queue;
+
+        struct queued_segment *it;
+        DL_FOREACH (read_queue, it) {
+            if (it->physical_pos >= elevator_pos) {
+                seg = it;
+                break;
+            }
+        }
+
+        DL_DELETE(read_queue, seg);
+
+        if (seg->stream->closed ||
+            consumer_passed(seg->stream, seg->entry_idx, seg->seq))  //
+        {
+            // Consumer already got past this file.
+            free_queued_segment(seg);
+            continue;
+        }
+
+        elevator_pos = seg->physical_pos;
+        return seg;
+    }
+
+    return NULL;
+}
+
+static void
+unpin_file(void *file)
+{
+    fd_pool_unpin(file);
+}
+
+static void
+read_segment(struct io_queue *queue, struct queued_segment *seg)
+{
+    LOG("%s: segment (%8zu, %7zu) path=%s", __func__, seg->physical_pos,
+        seg->extent_length, seg->file->path);
+    int fd = fd_pool_pin(seg->file);
+    if (fd < 0)
+        return;
+
+    io_queue_submit(queue, fd, seg->file_offset, seg->extent_length,
+                    unpin_file, seg->file);
+}
+
+static int
+inode_entry_comparator(const void *a, const void *b)
+{
+    const struct inode_entry *a_ = a;
+    const struct inode_entry *b_ = b;
+
+    return (a_->ino < b_->ino) ? -1 : (a_->ino > b_->ino);
+}
+
+static void
+unref_stat_prefetch(struct stat_prefetch *prefetch)
+{
+    if (--prefetch->refcount > 0)
+        return;
+
+    dir_snapshot_unref(prefetch->snapshot);
+    free(prefetch);
+}
+
+static void
+run_stat_prefetch(struct stat_prefetch *prefetch)
+{
+    struct dir_snapshot *snapshot = prefetch->snapshot;
+    size_t count = dir_snapshot_read_all(snapshot);
+    struct inode_entry *entries = xmalloc((count + 1) * sizeof(*entries));
+    size_t n = 0;
+
+    for (size_t k = 0; k < count; k++) {
+        struct dirent *de = dir_snapshot_entry(snapshot, k);
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        entries[n].ino = de->d_ino;
+        entries[n].name = de->d_name;
+        n += 1;
+    }
+
+    qsort(entries, n, sizeof(*entries), inode_entry_comparator);
+
+    int dir_fd = real_open(snapshot->dirname, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+        goto done;
+
+    LOG("%s: statting %zu entries of %s", __func__, n, snapshot->dirname);
+    for (size_t k = 0; k < n; k++) {
+        if (__atomic_load_n(&prefetch->closed, __ATOMIC_RELAXED))
+            break;
+
+        struct statx stx;
+        statx(dir_fd, entries[k].name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+              &stx);
+    }
+
+    real_close(dir_fd);
+
+done:
+    free(entries);
+}
+
+static void
+run_order_inference(struct order_inference *inference)
+{
+    size_t last_idx = 0;
+    struct dir_snapshot *ordered =
+        order_infer(inference->snapshot, inference->sample,
+                    inference->sample_len, &last_idx);
+
+    inference->done(inference->arg, inference->snapshot, ordered, last_idx);
+
+    for (size_t k = 0; k < inference->sample_len; k++)
+        free(inference->sample[k]);
+    dir_snapshot_unref(inference->snapshot);
+    free(inference);
+}
+
+static void *
+worker_thread(void *param)
+{
+    struct io_queue *queue = io_queue_new();
+    bool reads_pending = false;
+
+    pthread_mutex_lock(&worker_mutex);
+
+    while (1) {
+        struct precache_stream *to_map = NULL;
+        struct precache_stream *stream, *tmp;
+
+        // Consumer is about to stat entries, and that comes before reading.
+        if (stat_prefetches) {
+            struct stat_prefetch *prefetch = stat_prefetches;
+            DL_DELETE(stat_prefetches, prefetch);
+            pthread_mutex_unlock(&worker_mutex);
+            run_stat_prefetch(prefetch);
+            pthread_mutex_lock(&worker_mutex);
+            unref_stat_prefetch(prefetch);
+            continue;
+        }
+
+        // Consumer is opening files already, in an order yet to be learned.
+        if (order_inferences) {
+            struct order_inference *inference = order_inferences;
+            DL_DELETE(order_inferences, inference);
+            pthread_mutex_unlock(&worker_mutex);
+            run_order_inference(inference);
+            pthread_mutex_lock(&worker_mutex);
+            continue;
+        }
+
+        DL_FOREACH_SAFE (streams, stream, tmp) {
+            if (stream->closed) {
+                DL_DELETE(streams, stream);
+                unref_stream(stream);
+                continue;
+            }
+
+            if (!to_map && stream_wants_mapping(stream))
+                to_map = stream;
+        }
+
+        if (to_map) {
+            // Let other streams have their turn next time.
+            DL_DELETE(streams, to_map);
+            DL_APPEND(streams, to_map);
+            map_increment(to_map);
+            continue;
+        }
+
+        struct queued_segment *seg = pick_next_segment();
+        if (seg) {
+            pthread_mutex_unlock(&worker_mutex);
+            read_segment(queue, seg);
+            free_queued_segment(seg);
+            reads_pending = true;
+            pthread_mutex_lock(&worker_mutex);
+            continue;
+        }
+
+        if (reads_pending) {
+            // Nothing else to submit. Reads still in flight are waited for
+            // before going to sleep.
+            pthread_mutex_unlock(&worker_mutex);
+            io_queue_drain(queue);
+            reads_pending = false;
+            pthread_mutex_lock(&worker_mutex);
+            continue;
+        }
+
+        pthread_cond_wait(&worker_cond, &worker_mutex);
+    }
+
+    pthread_mutex_unlock(&worker_mutex);
+    io_queue_free(queue);
+    return NULL;
+}
+
+static void
+worker_atfork_child(void)
+{
+    // Worker thread doesn't exist in a child process. Streams are leaked, as
+    // DIR streams in the child still may refer to them.
+    pthread_mutex_init(&worker_mutex, NULL);
+    pthread_cond_init(&worker_cond, NULL);
+    streams = NULL;
+    stat_prefetches = NULL;
+    order_inferences = NULL;
+    read_queue = NULL;
+    worker_started = false;
+    fd_pool = NULL;
+}
+
+static void
+worker_register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, worker_atfork_child);
+}
+
+static void
+start_worker_thread(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all_signals;
+    sigset_t old_signals;
+
+    pthread_once(&worker_atfork_once, worker_register_atfork);
+
+    // Descriptors are shared with the application, so the worker only takes a
+    // small part of them.
+    if (!fd_pool)
+        fd_pool = fd_pool_new(8);
+
+    // The cache is only read, so a copy inherited through fork() is fine.
+    if (!extent_cache)
+        extent_cache = extent_cache_open();
+
+    // Application signal handlers should never run on the worker thread.
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, worker_thread, NULL) == 0)
+        worker_started = true;
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+struct precache_stream *
+precache_stream_new(struct dir_snapshot *snapshot, size_t start_idx,
+                    size_t window_bytes, size_t window_files, bool call_sync,
+                    bool recursive)
+{
+    struct precache_stream *stream = xcalloc(1, sizeof(*stream));
+
+    stream->refcount = 1;
+    stream->snapshot = dir_snapshot_ref(snapshot);
+    stream->window_bytes = window_bytes;
+    stream->window_files = window_files > 0 ? window_files : 1;
+    stream->call_sync = call_sync;
+    stream->recursive = recursive;
+    stream->cursor_idx = start_idx;
+    push_subtree_level(stream, dir_snapshot_ref(snapshot), "");
+    stream->levels->next_idx = start_idx;
+
+    pthread_mutex_lock(&worker_mutex);
+
+    if (!worker_started)
+        start_worker_thread();
+
+    if (worker_started) {
+        // Registry holds its own reference.
+        stream->refcount += 1;
+        DL_APPEND(streams, stream);
+        pthread_cond_signal(&worker_cond);
+    }
+
+    pthread_mutex_unlock(&worker_mutex);
+    return stream;
+}
+
+void
+precache_stream_advance(struct precache_stream *stream, size_t cursor_idx)
+{
+    pthread_mutex_lock(&worker_mutex);
+    if (cursor_idx > stream->cursor_idx) {
+        stream->cursor_idx = cursor_idx;
+        pthread_cond_signal(&worker_cond);
+    }
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+void
+precache_stream_advance_path(struct precache_stream *stream, const char *path)
+{
+    struct window_file *wf;
+
+    pthread_mutex_lock(&worker_mutex);
+    HASH_FIND_STR(stream->window_by_path, path, wf);
+    if (wf) {
+        if (wf->seq > stream->cursor_seq) {
+            stream->cursor_seq = wf->seq;
+            pthread_cond_signal(&worker_cond);
+        }
+        goto done;
+    }
+
+    // Not mapped yet, or not at all. Worker checks for it as it goes.
+    struct pending_path *pp;
+    HASH_FIND_STR(stream->pending_by_path, path, pp);
+    if (pp)
+        goto done;
+
+    if (stream->pending_count >= MAX_PENDING_PATHS)
+        forget_pending_path(stream, stream->pending);
+
+    pp = xcalloc(1, sizeof(*pp));
+    pp->path = xstrdup(path);
+    DL_APPEND(stream->pending, pp);
+    HASH_ADD_KEYPTR(hh, stream->pending_by_path, pp->path, strlen(pp->path),
+                    pp);
+    __atomic_add_fetch(&stream->pending_count, 1, __ATOMIC_RELAXED);
+
+done:
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+struct precache_stream *
+precache_stream_ref(struct precache_stream *stream)
+{
+    pthread_mutex_lock(&worker_mutex);
+    stream->refcount += 1;
+    pthread_mutex_unlock(&worker_mutex);
+    return stream;
+}
+
+void
+precache_stream_unref(struct precache_stream *stream)
+{
+    pthread_mutex_lock(&worker_mutex);
+    unref_stream(stream);
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+void
+precache_stream_close(struct precache_stream *stream)
+{
+    pthread_mutex_lock(&worker_mutex);
+    stream->closed = true;
+    drop_stream_segments(stream);
+    unref_stream(stream);
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+struct stat_prefetch *
+stat_prefetch_new(struct dir_snapshot *snapshot, bool sync)
+{
+    struct stat_prefetch *prefetch = xcalloc(1, sizeof(*prefetch));
+
+    prefetch->refcount = 1;
+    prefetch->snapshot = dir_snapshot_ref(snapshot);
+
+    if (sync) {
+        run_stat_prefetch(prefetch);
+        unref_stat_prefetch(prefetch);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&worker_mutex);
+
+    if (!worker_started)
+        start_worker_thread();
+
+    if (worker_started) {
+        // Queue holds its own reference.
+        prefetch->refcount += 1;
+        DL_APPEND(stat_prefetches, prefetch);
+        pthread_cond_signal(&worker_cond);
+    }
+
+    pthread_mutex_unlock(&worker_mutex);
+    return prefetch;
+}
+
+void
+stat_prefetch_close(struct stat_prefetch *prefetch)
+{
+    pthread_mutex_lock(&worker_mutex);
+    __atomic_store_n(&prefetch->closed, true, __ATOMIC_RELAXED);
+
+    // Not started yet. The queue holds a reference too.
+    int drops = 1;
+    struct stat_prefetch *it;
+    DL_FOREACH (stat_prefetches, it) {
+        if (it == prefetch) {
+            DL_DELETE(stat_prefetches, prefetch);
+            drops += 1;
+            break;
+        }
+    }
+
+    prefetch->refcount -= drops;
+    if (prefetch->refcount == 0) {
+        dir_snapshot_unref(prefetch->snapshot);
+        free(prefetch);
+    }
+    pthread_mutex_unlock(&worker_mutex);
+}
+
+void
+order_inference_start(struct dir_snapshot *snapshot, char **sample,
+                      size_t sample_len, order_inference_done_t done,
+                      void *arg)
+{
+    struct order_inference *inference = xcalloc(1, sizeof(*inference));
+
+    inference->snapshot = dir_snapshot_ref(snapshot);
+    for (size_t k = 0; k < sample_len; k++)
+        inference->sample[k] = sample[k];
+    inference->sample_len = sample_len;
+    inference->done = done;
+    inference->arg = arg;
+
+    pthread_mutex_lock(&worker_mutex);
+
+    if (!worker_started)
+        start_worker_thread();
+
+    if (worker_started) {
+        DL_APPEND(order_inferences, inference);
+        pthread_cond_signal(&worker_cond);
+        inference = NULL;
+    }
+
+    pthread_mutex_unlock(&worker_mutex);
+
+    // No worker thread, so it's done right here.
+    if (inference)
+        run_order_inference(inference);
+}
@@ -0,0 +1,75 @@
+// Copyright 2022  Rinat Ibragimov
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "dir_snapshot.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Read-ahead window over directory entries, maintained by the background
+// worker thread. Files are mapped in small increments, starting at entry
+// |start_idx|, while the window is not full. Window is full when it has either
+// |window_files| files, or |window_bytes| bytes of data ahead of the consumer
+// cursor. Mapped segments are read in the order of their physical positions.
+//
+// Recursive streams also enumerate subdirectories, and map files of the whole
+// subtree depth-first, as if it was a single directory. Files of a top-level
+// subdirectory are kept while the consumer is at that subdirectory's entry.
+struct precache_stream;
+struct stat_prefetch;
+
+// Called on the worker thread with the result of order_infer(). Takes
+// ownership of |ordered|. |snapshot| stays referenced for the call.
+typedef void (*order_inference_done_t)(void *arg,
+                                       struct dir_snapshot *snapshot,
+                                       struct dir_snapshot *ordered,
+                                       size_t last_idx);
+
+struct precache_stream *
+precache_stream_new(struct dir_snapshot *snapshot, size_t start_idx,
+                    size_t window_bytes, size_t window_files, bool call_sync,
+                    bool recursive);
+
+// Tells the worker that the consumer is at entry |cursor_idx|. Entries before
+// that are not needed anymore, so the window slides forward.
+void
+precache_stream_advance(struct precache_stream *stream, size_t cursor_idx);
+
+// Tells a recursive stream that the consumer opened |path|, relative to the
+// stream directory. Files mapped before that one are not needed anymore. If
+// it's not mapped yet, that's applied once the worker gets to it.
+void
+precache_stream_advance_path(struct precache_stream *stream, const char *path);
+
+// References for states of subdirectories, which follow an ancestor's
+// recursive stream. Only the owner closes the stream.
+struct precache_stream *
+precache_stream_ref(struct precache_stream *stream);
+
+void
+precache_stream_unref(struct precache_stream *stream);
+
+// Stops precaching and releases the stream.
+void
+precache_stream_close(struct precache_stream *stream);
+
+// Stats entries of |snapshot| in the order of their inode numbers. Consumers
+// like file managers stat every entry right after opening a directory, and
+// inodes are then read in a single pass over the inode tables instead of in
+// readdir order. Statting is done by the worker thread, unless |sync| is set.
+// Returns NULL if it's done already.
+struct stat_prefetch *
+stat_prefetch_new(struct dir_snapshot *snapshot, bool sync);
+
+// Stops statting, if it's still in progress, and releases the job.
+void
+stat_prefetch_close(struct stat_prefetch *prefetch);
+
+// Runs order_infer() for |sample| of names opened in |snapshot| on the worker
+// thread, as it may stat every entry. Takes ownership of the sample strings.
+// |done| is called once, with |arg|, without any worker locks held.
+void
+order_inference_start(struct dir_snapshot *snapshot, char **sample,
+                      size_t sample_len, order_inference_done_t done,
+                      void *arg);